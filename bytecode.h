@@ -0,0 +1,43 @@
+/*
+ * bytecode.h
+ *
+ * Bytecode of the user programs, shared by the firmware (main.c, built
+ * with USER_PROGRAMS) and the host driver (hal_host.c).
+ *
+ * A user program takes the place of the built-in program of one
+ * position of the mode switch. It is up to USER_PROGRAM_SIZE bytes of
+ * instructions, each an opcode byte followed by its operands, run in
+ * order from the first. Every wait is one phase of the program: it
+ * runs for that many program ticks with the LED pattern and the motor
+ * duty set before it. With SPEED_CONTROL the duty level also sets the
+ * drum speed, as in the built-in programs (150, 600 or 1200 rpm).
+ *
+ * A program is checked before it is saved, and must:
+ *  - only hold the instructions below, with their operands in range;
+ *  - set a pattern and a duty before its first wait;
+ *  - hold every instruction whole, with all its operands;
+ *  - end with OP_END, as its last byte;
+ *  - loop only backwards, to the start of an instruction after any
+ *    loop before it (loops do not nest), with a wait in every loop;
+ *  - last 1 - 65535 ticks in all, loops included.
+ * These bound the instructions run between two phases to the length
+ * of the program.
+ *
+ * For example, wash for 20 ticks then rinse for 12 and spin for 8,
+ * three times over (80 ticks in all):
+ *     1 0  2 0  3 20 0  1 1  2 1  3 12 0  1 2  2 2  3 8 0  4 7 3  0
+ */
+
+#ifndef BYTECODE_H_
+#define BYTECODE_H_
+
+#define USER_PROGRAM_SIZE 64 // longest program, in bytes
+
+#define OP_END 0     // end of the program
+#define OP_PATTERN 1 // pattern: LED pattern (and running state), WASH_PATTERN - SPIN_PATTERN
+#define OP_DUTY 2    // level: motor duty pwm[level], 0 - 2
+#define OP_WAIT 3    // ticks (2 bytes, little endian): a phase, 1 - 65535 ticks long
+#define OP_LOOP 4    // offset, count: run from the instruction at offset to here count times in all, 1 - 255
+#define OP_COUNT 5
+
+#endif /* BYTECODE_H_ */
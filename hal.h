@@ -0,0 +1,244 @@
+/*
+ * hal.h
+ *
+ * Register access layer for AVRProgrammingTask.
+ *
+ * On the AVR this file only pulls in the avr-libc headers, so every
+ * register access in main.c compiles to exactly the same instructions
+ * as before. When HAL_HOST is defined the I/O registers become plain
+ * variables (defined in hal_host.c) and ISR() declares an ordinary
+ * function, so the same main.c can be built as a native Linux binary:
+ *
+ *     gcc -DHAL_HOST -O2 -o washsim main.c hal_host.c
+ */
+
+#ifndef HAL_H_
+#define HAL_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifndef F_CPU
+#define F_CPU 8000000UL
+#endif
+
+#ifndef HAL_HOST
+
+#include <avr/io.h>
+#include <avr/eeprom.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <avr/sleep.h>
+#include <avr/wdt.h>
+#include <util/atomic.h>
+
+/* Variables kept through a reset: not cleared or initialized at startup. */
+#define NOINIT __attribute__((section(".noinit")))
+/* Runs from the startup code, before RAM is initialized. */
+#define INIT3 __attribute__((naked, used, section(".init3")))
+
+#else
+
+/* Port registers */
+extern volatile uint8_t DDRA, PORTA;
+extern volatile uint8_t DDRB, PORTB;
+extern volatile uint8_t DDRC, PORTC;
+extern volatile uint8_t DDRD, PORTD, PIND;
+
+/* Timer 0 */
+extern volatile uint8_t TCCR0A, TCCR0B, OCR0B, TIMSK0, TIFR0;
+/* Timer 1 */
+extern volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+extern volatile uint16_t OCR1A, ICR1, TCNT1;
+/* Timer 2 */
+extern volatile uint8_t TCCR2A, TCCR2B, OCR2A, TIMSK2, TIFR2;
+/* ADC */
+extern volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0;
+extern volatile uint16_t ADC;
+/* EEPROM */
+extern volatile uint16_t EEAR;
+extern volatile uint8_t EEDR, EECR;
+/* USART0 (UDR0 is 16 bits on the host, so the driver can tell a byte
+ * written to it from none)
+ */
+extern volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+extern volatile uint16_t UBRR0, UDR0;
+/* External interrupts */
+extern volatile uint8_t EICRA, EIMSK, EIFR;
+/* Pin change interrupts */
+extern volatile uint8_t PCICR, PCIFR, PCMSK3;
+/* Power reduction */
+extern volatile uint8_t PRR0;
+/* Reset flags */
+extern volatile uint8_t MCUSR;
+
+/* Bit numbers, as in the ATmega324A datasheet */
+#define PIND4 4
+#define PIND3 3
+#define PIND2 2
+#define PORTB4 4
+#define PORTD5 5
+
+#define COM0B1 5
+#define COM0B0 4
+#define WGM01 1
+#define WGM00 0
+#define WGM02 3
+#define CS02 2
+#define CS01 1
+#define CS00 0
+#define TOIE0 0
+#define TOV0 0
+
+#define COM1A1 7
+#define COM1A0 6
+#define WGM11 1
+#define WGM10 0
+#define WGM13 4
+#define WGM12 3
+#define CS12 2
+#define CS11 1
+#define CS10 0
+#define OCIE1A 1
+#define OCF1A 1
+#define TOIE1 0
+#define TOV1 0
+#define ICNC1 7
+#define ICES1 6
+#define ICIE1 5
+#define ICF1 5
+
+#define WGM21 1
+#define WGM20 0
+#define WGM22 3
+#define CS22 2
+#define CS21 1
+#define CS20 0
+#define OCIE2A 1
+#define OCF2A 1
+
+#define REFS1 7
+#define REFS0 6
+#define ADEN 7
+#define ADSC 6
+#define ADATE 5
+#define ADIF 4
+#define ADIE 3
+#define ADPS2 2
+#define ADPS1 1
+#define ADPS0 0
+
+#define EERIE 3
+#define EEMPE 2
+#define EEPE 1
+#define EERE 0
+
+#define RXC0 7
+#define TXC0 6
+#define UDRE0 5
+#define FE0 4
+#define DOR0 3
+#define UPE0 2
+#define U2X0 1
+#define RXCIE0 7
+#define TXCIE0 6
+#define UDRIE0 5
+#define RXEN0 4
+#define TXEN0 3
+#define UCSZ01 2
+#define UCSZ00 1
+
+#define ISC11 3
+#define ISC10 2
+#define ISC01 1
+#define ISC00 0
+#define INT1 1
+#define INT0 0
+#define INTF1 1
+#define INTF0 0
+#define PCIE3 3
+#define PCIF3 3
+#define PCINT27 3
+#define PCINT26 2
+
+#define JTRF 4
+#define WDRF 3
+#define BORF 2
+#define EXTRF 1
+#define PORF 0
+
+#define PRTWI 7
+#define PRTIM2 6
+#define PRTIM0 5
+#define PRUSART1 4
+#define PRTIM1 3
+#define PRSPI 2
+#define PRUSART0 1
+#define PRADC 0
+
+/* Interrupt vectors become plain functions the host driver can call. */
+#define ISR(vector) void vector(void)
+void PCINT3_vect(void);
+void TIMER0_OVF_vect(void);
+void TIMER1_COMPA_vect(void);
+void TIMER1_OVF_vect(void);
+void TIMER1_CAPT_vect(void);
+void TIMER2_COMPA_vect(void);
+void ADC_vect(void);
+void EE_READY_vect(void);
+void USART0_RX_vect(void);
+void USART0_UDRE_vect(void);
+
+/* EEPROM reads, as in avr-libc, from the host driver's EEPROM image. */
+uint8_t eeprom_read_byte(const uint8_t *address);
+void eeprom_read_block(void *destination, const void *source, size_t size);
+
+/* Flash and RAM share one address space on the host. */
+#define PROGMEM
+#define pgm_read_byte(address) (*(const uint8_t *)(address))
+#define pgm_read_word(address) (*(const uint16_t *)(address))
+#define memcpy_P(destination, source, size) memcpy(destination, source, size)
+#define PSTR(text) (text)
+
+/* Watchdog, modelled by the host driver: it resets the firmware if
+ * wdt_reset() is not called within the timeout.
+ */
+#define WDTO_15MS 0
+#define WDTO_30MS 1
+#define WDTO_60MS 2
+#define WDTO_120MS 3
+#define WDTO_250MS 4
+#define WDTO_500MS 5
+#define WDTO_1S 6
+#define WDTO_2S 7
+void wdt_enable(uint8_t timeout);
+void wdt_disable(void);
+void wdt_reset(void);
+
+/* The host driver resets the firmware without clearing its RAM, and
+ * calls the startup code itself.
+ */
+#define NOINIT
+#define INIT3
+
+/* Sleep, modelled by the host driver. Idle sleep ends at the next
+ * interrupt, as it would anyway. In power-down sleep_cpu() only returns
+ * once a wake-up interrupt the part could really take has run.
+ */
+#define SLEEP_MODE_IDLE 0
+#define SLEEP_MODE_PWR_DOWN 2
+void set_sleep_mode(uint8_t mode);
+#define sleep_enable()
+#define sleep_disable()
+void sleep_cpu(void);
+
+/* The host driver calls ISRs one at a time, so there is nothing to mask. */
+#define ATOMIC_RESTORESTATE
+#define ATOMIC_BLOCK(type) for (uint8_t atomicOnce = 1; atomicOnce; atomicOnce = 0)
+#define sei()
+#define cli()
+
+#endif /* HAL_HOST */
+
+#endif /* HAL_H_ */
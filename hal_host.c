@@ -0,0 +1,1439 @@
+/*
+ * hal_host.c
+ *
+ * Host backend for hal.h. Provides the register variables and a small
+ * driver that plays the part of the hardware: it raises the pin change
+ * interrupt when a button is "pressed" and calls the motor PWM timer
+ * overflow and Timer 1 and Timer 2 compare ISRs whenever those timers
+ * would have reached their overflow or compare values, keeping count
+ * of the CPU cycles that would have passed. A full wash program
+ * therefore runs in microseconds instead of tens of seconds.
+ *
+ * Each finished program's duration, from the program starting to the
+ * tick that ends it, is compared with the specified 16 ticks every 3
+ * seconds; the exit status is non-zero if any is out by more than one
+ * CPU cycle. Programs that are paused part way must take exactly as
+ * long plus the pause, to within the tick count that was in progress
+ * when paused. Every motor duty committed at a tick must be off, 10%,
+ * 50% or 90% to within two steps of the PWM resolution.
+ *
+ * With SPEED_CONTROL a model of the motor and drum turns the motor duty
+ * into tacho pulses on ICP1 instead, and once the target speed of a
+ * phase has had time to settle the drum must be within SPEED_TOLERANCE
+ * of it at every tick, whatever load the scenario puts on the drum.
+ * With LEVEL_ADC the water level of each scenario is fed to the ADC as
+ * a noisy analog reading, and must be read back as the same level.
+ *
+ * Checkpoints are written to an EEPROM image that survives the power
+ * cuts some scenarios make part way through a program: the program
+ * must then carry on from no more than CHECKPOINT_TICKS ticks before
+ * the cut and still run to the end, in exactly its remaining time.
+ * The watchdog is modelled too. It must never go off, except in the
+ * scenarios that hang the firmware's main loop part way through a
+ * program: the watchdog reset must then come within its timeout and
+ * the program carry on from the very tick it had reached.
+ * Power-down is modelled as well: the firmware must only power down in
+ * the scenario that leaves it idle past its timeout, and the button
+ * press that follows must wake it through an interrupt the part could
+ * really take in power-down.
+ *
+ * With TELEMETRY the USART sends the firmware's telemetry bytes at its
+ * baud rate, and none of its frames may be dropped; the bytes sent in
+ * the checked scenarios are saved to the file named on the command
+ * line, for sim/telemetry.c to decode. With SHELL some scenarios also
+ * type a command line into the USART part way through a program, and
+ * the command must have done what it should without the shell
+ * reporting an error or dropping a character. With USER_PROGRAMS some
+ * upload a user program through the shell before starting it, and it
+ * must run for the ticks it was written for, through power cuts and
+ * hangs as well. "./washsim pty" instead runs the firmware in real
+ * time, with its USART on a pseudo-terminal, for the shell to be tried
+ * by hand:
+ *     ./washsim pty [PIND in hex] &
+ *     ./telemetry < /dev/pts/N &
+ *     echo start > /dev/pts/N
+ *
+ * The firmware's state machine transition table is checked first.
+ *
+ * Build and run (add -DMOTOR_PWM_TIMER1 for the Timer 1 motor PWM,
+ * -DSPEED_CONTROL for closed loop drum speed control, -DLEVEL_ADC for
+ * analog water level sensing, -DLEVEL_ADC -DTELEMETRY for telemetry,
+ * -DLEVEL_ADC -DTELEMETRY -DSHELL for the command shell as well or
+ * -DLEVEL_ADC -DTELEMETRY -DSHELL -DUSER_PROGRAMS for user programs):
+ *     gcc -DHAL_HOST -O2 -o washsim main.c hal_host.c
+ *     ./washsim [iterations [telemetry file]]
+ */
+
+#ifdef SHELL
+#define _GNU_SOURCE // pseudo-terminals
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "hal.h"
+#include "statemachine.h"
+#include "bytecode.h"
+
+volatile uint8_t DDRA, PORTA;
+volatile uint8_t DDRB, PORTB;
+volatile uint8_t DDRC, PORTC;
+volatile uint8_t DDRD, PORTD, PIND;
+volatile uint8_t TCCR0A, TCCR0B, OCR0B, TIMSK0, TIFR0;
+volatile uint8_t TCCR1A, TCCR1B, TIMSK1, TIFR1;
+volatile uint16_t OCR1A, ICR1, TCNT1;
+volatile uint8_t TCCR2A, TCCR2B, OCR2A, TIMSK2, TIFR2;
+volatile uint8_t ADMUX, ADCSRA, ADCSRB, DIDR0;
+volatile uint16_t ADC;
+volatile uint16_t EEAR;
+volatile uint8_t EEDR, EECR;
+volatile uint8_t UCSR0A, UCSR0B, UCSR0C;
+volatile uint16_t UBRR0, UDR0;
+volatile uint8_t EICRA, EIMSK, EIFR;
+volatile uint8_t PCICR, PCIFR, PCMSK3;
+volatile uint8_t PRR0;
+volatile uint8_t MCUSR;
+
+/* Specified program tick rate: 16 ticks every 3 seconds */
+#define SPEC_TICK_CYCLES(ticks) ((uint64_t)(ticks) * F_CPU * 3 / 16)
+
+/* Firmware entry points and state from main.c */
+void saveResetFlags(void);
+void setup(void);
+void processEvents(void);
+void enterSleep(void);
+void restoreCheckpoint(void);
+uint16_t programClock(void);
+extern volatile uint8_t state;
+
+/* The motor PWM timer, as selected in main.c: its compare register, the
+ * counts in one PWM period and its overflow interrupt.
+ */
+#ifdef MOTOR_PWM_TIMER1
+extern volatile uint16_t tickCountdown;
+extern volatile uint8_t tickRunning;
+#define MOTOR_OCR OCR1A
+#define MOTOR_PWM_COUNTS ICR1
+#define MOTOR_OVF_vect TIMER1_OVF_vect
+#define MOTOR_TIMSK TIMSK1
+#define MOTOR_TOIE TOIE1
+#else
+#define MOTOR_OCR OCR0B
+#define MOTOR_PWM_COUNTS 256
+#define MOTOR_OVF_vect TIMER0_OVF_vect
+#define MOTOR_TIMSK TIMSK0
+#define MOTOR_TOIE TOIE0
+#endif
+
+#ifdef SPEED_CONTROL
+extern uint16_t speedTarget;
+/* Motor and drum model: with the full duty and no load the drum runs
+ * at MODEL_RPM, and it settles towards the speed the duty and load
+ * give with time constant MODEL_TAU seconds. The tacho gives
+ * MODEL_PULSES_PER_REV pulses per revolution, as TACHO_PULSES_PER_REV
+ * in main.c.
+ */
+#define MODEL_RPM 1600.0
+#define MODEL_TAU 0.25
+#define MODEL_PULSES_PER_REV 8
+/* The drum must be within this fraction of the target speed at every
+ * tick from SPEED_SETTLE cycles after the target or the load last
+ * changed, or the program last started running again.
+ */
+#define SPEED_TOLERANCE 0.05
+#define SPEED_SETTLE (F_CPU * 3 / 2)
+#endif
+
+#ifdef LEVEL_ADC
+extern volatile uint8_t levelQuantized;
+extern volatile uint16_t levelFine;
+/* Water level sensor model: the ADC reading (10 bits) in the middle of
+ * each level's band, as LEVEL_EMPTY - LEVEL_FULL in main.c split in
+ * thirds, or 0 for a disconnected sensor (level 3), plus up to
+ * LEVEL_NOISE counts of noise either way on every conversion.
+ */
+static const uint16_t levelReadings[4] = {239, 512, 785, 0};
+#define LEVEL_NOISE 24
+#endif
+
+/* EEPROM: its contents, which are kept through hostReset() (only a new
+ * scenario erases them), and the CPU cycles one byte takes to write
+ * (3.4 ms). A power cut loses no more than the checkpoints not yet
+ * written, as CHECKPOINT_TICKS in main.c.
+ */
+static uint8_t eeprom[1024];
+#define EEPROM_WRITE_CYCLES (F_CPU * 34 / 10000)
+#define CHECKPOINT_TICKS 16
+
+#ifdef TELEMETRY
+extern uint8_t telemetryLost;
+/* USART0: the file the bytes it sends are saved to (NULL = not saved),
+ * the bytes and frames it has sent and the frames the firmware dropped.
+ * UDR0 holds UART_EMPTY until the ISR writes a byte to it.
+ */
+static FILE *telemetryFile;
+static unsigned long telemetryBytes;
+static unsigned long telemetryFrames;
+static unsigned long telemetryDropped;
+#define UART_EMPTY 0x100
+#endif
+
+#ifdef SHELL
+extern volatile uint8_t shellDropped;
+extern uint8_t shellErrors;
+#ifdef MOTOR_PWM_TIMER1
+extern uint16_t pwm[3];
+#else
+extern uint8_t pwm[3];
+#endif
+/* Characters waiting to be received by USART0, the pseudo-terminal its
+ * bytes go to and come from in real time (-1 = none), and the pwm[]
+ * levels the firmware was built with, put back before each scenario as
+ * reflashing would.
+ */
+static uint8_t uartInput[256];
+static uint8_t uartInputHead;
+static uint8_t uartInputTail;
+static int ptyFd = -1;
+static uint8_t pwmBuilt[sizeof(pwm)];
+#endif
+
+#ifdef USER_PROGRAMS
+/* User program the user scenarios upload (the example in bytecode.h):
+ * wash for 20 ticks, then rinse for 12 and spin for 8 three times over.
+ */
+static const uint8_t userProgram[] = {
+	OP_PATTERN, 0, OP_DUTY, 0, OP_WAIT, 20, 0,
+	OP_PATTERN, 1, OP_DUTY, 1, OP_WAIT, 12, 0,
+	OP_PATTERN, 2, OP_DUTY, 2, OP_WAIT, 8, 0,
+	OP_LOOP, 7, 3,
+	OP_END,
+};
+#define USER_PROGRAM_TICKS 80
+#endif
+
+/* Watchdog: CPU cycles it waits to be fed (0 = stopped), the cycle it
+ * was last fed and the cycle it last reset the MCU. The watchdog
+ * oscillator runs at 128 kHz.
+ */
+static uint64_t watchdogPeriod;
+static uint64_t watchdogFed;
+static uint64_t watchdogWentOff;
+/* 1 while the firmware's main loop is hung: the ISRs still run, but
+ * nothing handles their events or feeds the watchdog
+ */
+static uint8_t hung;
+
+/* Sleep mode the firmware last selected, the times it has powered down
+ * and the times it powered down with no interrupt that could wake it.
+ * wakePin is the button pressed a second into each power-down; it is
+ * held for 50 ms, until releaseDue (0 = not held).
+ */
+static uint8_t sleepMode;
+static uint16_t powerDowns;
+static uint16_t wakeRefused;
+static uint8_t wakePin = PIND2;
+static uint64_t releaseDue;
+
+/* CPU cycles elapsed since the last hostReset() */
+static uint64_t cycles;
+
+/* Cycle of each timer's next interrupt (0 = not running) */
+static uint64_t motorDue;
+static uint64_t timer1Due;
+static uint64_t timer2Due;
+/* Cycle of the next EEPROM ready interrupt (0 = disabled), and the
+ * cycle the byte being written is done
+ */
+static uint64_t eepromDue;
+static uint64_t eepromReady;
+/* Cycle the watchdog goes off (0 = stopped) */
+static uint64_t watchdogDue;
+#ifdef TELEMETRY
+/* Cycle of the next USART data register empty interrupt (0 = disabled),
+ * and the cycle the byte being sent is done
+ */
+static uint64_t uartDue;
+static uint64_t uartReady;
+#endif
+#ifdef SHELL
+/* Cycle of the next USART receive complete interrupt (0 = nothing to
+ * receive), and the cycle the last byte was received
+ */
+static uint64_t uartRxDue;
+static uint64_t uartRxReady;
+#endif
+#ifdef LEVEL_ADC
+static uint64_t adcDue;
+/* Sensor reading for the scenario's water level, and the noise generator */
+static uint16_t levelReading;
+static uint32_t levelNoise;
+/* Scenarios whose water level was read back wrong */
+static unsigned long levelErrors;
+#endif
+/* Cycle at which the program last started */
+static uint64_t programStart;
+/* Cycle at which TCNT1 was last 0, and the prescaler it has counted with */
+static uint64_t timer1Base;
+static uint16_t timer1Prescaler;
+/* 1 while Timer 1's clock is stopped with its interrupt still enabled */
+static uint8_t timer1Paused;
+
+/* Program ticks and FNV-1a hash of every PORTC/motor compare output
+ * since the last hostReset(). The outputs of a tick are hashed once
+ * they have been committed (traceDue is set until then).
+ */
+static uint16_t ticks;
+static uint32_t trace;
+static uint8_t traceDue;
+#ifndef SPEED_CONTROL
+/* Motor duties checked, and how many were not one of the pwm[] levels */
+static unsigned long dutyChecks;
+static unsigned long dutyErrors;
+#endif
+/* Firmware state after the last event was handled */
+static uint8_t lastState;
+#ifdef SPEED_CONTROL
+/* Drum speed (rpm), tacho pulses turned since the last hostReset(),
+ * the cycle the model has been run up to, the cycle of the next tacho
+ * pulse (0 = none coming) and the load on the drum (0 - 1, the
+ * fraction of the motor's torque it takes).
+ */
+static double drumRpm;
+static double drumPulses;
+static uint64_t drumCycles;
+static uint64_t tachoDue;
+static double drumLoad;
+/* Cycle the speed target last changed, and what it was */
+static uint64_t targetSince;
+static uint16_t targetRpm;
+/* Speeds checked, how many were out by more than SPEED_TOLERANCE and the
+ * largest error seen
+ */
+static unsigned long speedChecks;
+static unsigned long speedErrors;
+static double speedWorst;
+#endif
+/* Whether the firmware is paused (in STATE_PAUSED or STATE_ERROR), the
+ * cycle it last entered one of them and the total cycles it has spent
+ * paused
+ */
+static uint8_t pausedNow;
+static uint64_t pausedAt;
+static uint64_t pausedCycles;
+
+/* Timer 1 prescaler, 0 if its clock is stopped */
+static uint16_t timer1Prescale(void) {
+	static const uint16_t prescalers[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+	return prescalers[TCCR1B & 7];
+}
+
+/* CPU cycles between motor PWM timer overflows (0 = stopped, gated or masked) */
+static uint64_t motorPeriod(void) {
+#ifdef MOTOR_PWM_TIMER1
+	// phase correct PWM counts up to ICR1 and back down
+	if ((PRR0 & (1 << PRTIM1)) || (TIMSK1 & (1 << TOIE1)) == 0) {
+		return 0;
+	}
+	return 2 * (uint64_t)ICR1 * timer1Prescale();
+#else
+	static const uint16_t prescalers[8] = {0, 1, 8, 64, 256, 1024, 0, 0};
+	if ((PRR0 & (1 << PRTIM0)) || (TIMSK0 & (1 << TOIE0)) == 0) {
+		return 0;
+	}
+	return 256 * (uint64_t)prescalers[TCCR0B & 7];
+#endif
+}
+
+/* CPU cycles between Timer 1 compare matches (0 = stopped, gated or masked) */
+static uint64_t timer1Period(void) {
+	if ((PRR0 & (1 << PRTIM1)) || (TIMSK1 & (1 << OCIE1A)) == 0) {
+		return 0;
+	}
+	return (uint64_t)(OCR1A + 1) * timer1Prescale();
+}
+
+/* CPU cycles between Timer 2 compare matches (0 = stopped, gated or masked) */
+static uint64_t timer2Period(void) {
+	static const uint16_t prescalers[8] = {0, 1, 8, 32, 64, 128, 256, 1024};
+	if ((PRR0 & (1 << PRTIM2)) || (TIMSK2 & (1 << OCIE2A)) == 0) {
+		return 0;
+	}
+	return (uint64_t)(OCR2A + 1) * prescalers[TCCR2B & 7];
+}
+
+#ifdef LEVEL_ADC
+/* CPU cycles between ADC conversions in free running mode (0 = stopped,
+ * gated or masked)
+ */
+static uint64_t adcPeriod(void) {
+	const uint8_t running = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIE);
+	if ((PRR0 & (1 << PRADC)) || (ADCSRA & running) != running) {
+		return 0;
+	}
+	return 13 * (uint64_t)(2 << ((ADCSRA & 7) ? (ADCSRA & 7) - 1 : 0));
+}
+
+/* One noisy conversion of the water level sensor. */
+static uint16_t hostLevelConversion(void) {
+	int32_t reading;
+	levelNoise = levelNoise * 1103515245u + 12345u;
+	reading = levelReading + (int32_t)((levelNoise >> 16) % (2 * LEVEL_NOISE + 1)) - LEVEL_NOISE;
+	return reading < 0 ? 0 : reading > 1023 ? 1023 : reading;
+}
+#endif
+
+#ifdef TELEMETRY
+/* CPU cycles to send or receive one byte, with a start and a stop bit
+ * (0 = the transmitter and receiver are off or gated)
+ */
+static uint64_t uartPeriod(void) {
+	if ((PRR0 & (1 << PRUSART0)) || (UCSR0B & ((1 << TXEN0) | (1 << RXEN0))) == 0) {
+		return 0;
+	}
+	return 10 * ((UCSR0A & (1 << U2X0)) ? 8 : 16) * (uint64_t)(UBRR0 + 1);
+}
+#endif
+
+uint8_t eeprom_read_byte(const uint8_t *address) {
+	return eeprom[(uintptr_t)address & (sizeof(eeprom) - 1)];
+}
+
+void eeprom_read_block(void *destination, const void *source, size_t size) {
+	while (size--) {
+		*(uint8_t *)destination = eeprom_read_byte(source);
+		destination = (uint8_t *)destination + 1;
+		source = (const uint8_t *)source + 1;
+	}
+}
+
+void wdt_enable(uint8_t timeout) {
+	watchdogPeriod = (uint64_t)F_CPU * (2048 << timeout) / 128000;
+	watchdogFed = cycles;
+}
+
+void wdt_disable(void) {
+	watchdogPeriod = 0;
+}
+
+void wdt_reset(void) {
+	watchdogFed = cycles;
+}
+
+static void hostTrackState(void);
+
+/* Reset, with the given reset flags: all registers zero, then the
+ * firmware's startup code, setup() and its restore from the last
+ * checkpoint. The firmware's RAM is left as it was.
+ */
+static void hostReset(uint8_t pind, uint8_t flags) {
+	DDRA = PORTA = DDRB = PORTB = DDRC = PORTC = 0;
+	DDRD = PORTD = 0;
+	TCCR0A = TCCR0B = OCR0B = TIMSK0 = TIFR0 = 0;
+	TCCR1A = TCCR1B = TIMSK1 = TIFR1 = 0;
+	OCR1A = ICR1 = TCNT1 = 0;
+	TCCR2A = TCCR2B = OCR2A = TIMSK2 = TIFR2 = 0;
+	ADMUX = ADCSRA = ADCSRB = DIDR0 = 0;
+	ADC = 0;
+	EEAR = 0;
+	EEDR = EECR = 0;
+	UCSR0A = UCSR0B = UCSR0C = 0;
+	UBRR0 = UDR0 = 0;
+	EICRA = EIMSK = EIFR = 0;
+	PCICR = PCIFR = PCMSK3 = 0;
+	PRR0 = 0;
+	MCUSR = flags;
+	PIND = pind;
+	cycles = 0;
+	motorDue = timer1Due = timer2Due = 0;
+	eepromDue = eepromReady = 0;
+#ifdef TELEMETRY
+	uartDue = uartReady = 0;
+	telemetryDropped += telemetryLost; // setup() clears it
+#endif
+#ifdef SHELL
+	uartRxDue = uartRxReady = 0;
+	uartInputTail = uartInputHead; // a reset loses what was on its way
+#endif
+	watchdogPeriod = 0;
+	hung = 0;
+	sleepMode = SLEEP_MODE_IDLE;
+	releaseDue = 0;
+	timer1Paused = 0;
+	ticks = 0;
+	trace = 2166136261u;
+	traceDue = 0;
+	pausedNow = 0;
+	pausedAt = pausedCycles = 0;
+	programStart = 0;
+#ifdef LEVEL_ADC
+	adcDue = 0;
+	levelReading = levelReadings[pind & 3];
+	levelNoise = 1;
+#endif
+#ifdef SPEED_CONTROL
+	drumRpm = drumPulses = 0;
+	drumCycles = tachoDue = 0;
+	targetSince = 0;
+	targetRpm = 0;
+#endif
+	saveResetFlags();
+	setup();
+	restoreCheckpoint();
+	lastState = state;
+	hostTrackState(); // the program may carry on paused
+}
+
+#ifndef SPEED_CONTROL
+/* Check a committed motor compare value gives one of the firmware's
+ * duty levels: off, 10%, 50% or 90% of the PWM period (the output is
+ * inverted, so the motor is on for the counts above the compare value).
+ * The value has to be a whole number of counts, so it may be out by up
+ * to two steps of the PWM resolution.
+ */
+static void hostCheckDuty(void) {
+	static const int levels[4] = {0, 100, 500, 900};
+	int32_t permille = (int32_t)(MOTOR_PWM_COUNTS - MOTOR_OCR) * 1000 / MOTOR_PWM_COUNTS;
+	int32_t allowed = 2000 / MOTOR_PWM_COUNTS + 1;
+	int i;
+
+	dutyChecks++;
+	for (i = 0; i < 4; i++) {
+		if (permille - levels[i] <= allowed && levels[i] - permille <= allowed) {
+			return;
+		}
+	}
+	dutyErrors++;
+}
+#else
+/* Fraction of the time the motor is on: the inverted PWM output is on
+ * above OCR0B, and off while it is disconnected or Timer 0 is stopped.
+ */
+static double hostMotorDrive(void) {
+	if ((PRR0 & (1 << PRTIM0)) || (TCCR0A & (1 << COM0B1)) == 0 || (TCCR0B & 7) == 0) {
+		return 0;
+	}
+	return (255 - OCR0B) / 256.0;
+}
+
+/* Run the motor model up to the given cycle. The drum turns at the
+ * speed it had at the start, so the next tacho pulse falls exactly
+ * where hostStep() predicted it.
+ */
+static void hostMotorRun(uint64_t until) {
+	double seconds = (double)(until - drumCycles) / F_CPU;
+	double settled = MODEL_RPM * hostMotorDrive() * (1 - drumLoad);
+	drumPulses += drumRpm * MODEL_PULSES_PER_REV / 60 * seconds;
+	drumRpm += (settled - drumRpm) * (seconds < MODEL_TAU ? seconds / MODEL_TAU : 1);
+	drumCycles = until;
+}
+
+/* Cycle of the next tacho pulse at the drum's present speed (0 if the
+ * drum is standing still).
+ */
+static uint64_t hostTachoDue(void) {
+	double pulsesPerCycle = drumRpm * MODEL_PULSES_PER_REV / 60 / F_CPU;
+	double left = (uint64_t)drumPulses + 1 - drumPulses;
+	if (drumRpm < 1) {
+		return 0;
+	}
+	return drumCycles + (uint64_t)(left / pulsesPerCycle) + 1;
+}
+
+/* Check the drum speed once the target has had time to settle. */
+static void hostCheckSpeed(void) {
+	double error;
+	if (speedTarget != targetRpm) {
+		targetRpm = speedTarget;
+		targetSince = cycles;
+	}
+	if (state < STATE_WASH || state > STATE_SPIN || targetRpm == 0 || cycles - targetSince < SPEED_SETTLE) {
+		return;
+	}
+	error = (drumRpm - targetRpm) / targetRpm;
+	error = error < 0 ? -error : error;
+	speedChecks++;
+	if (error > speedWorst) {
+		speedWorst = error;
+	}
+	if (error > SPEED_TOLERANCE) {
+		speedErrors++;
+	}
+}
+#endif
+
+/* Once a tick's outputs have been committed, check the motor duty (or
+ * with SPEED_CONTROL the drum speed) and add them to the trace.
+ */
+static void hostTrace(void) {
+	if (traceDue && (MOTOR_TIMSK & (1 << MOTOR_TOIE)) == 0) {
+#ifdef SPEED_CONTROL
+		hostCheckSpeed();
+#else
+		hostCheckDuty();
+#endif
+		trace = (trace ^ PORTC) * 16777619u;
+		trace = (trace ^ (uint8_t)MOTOR_OCR) * 16777619u;
+#ifdef MOTOR_PWM_TIMER1
+		trace = (trace ^ (uint8_t)(MOTOR_OCR >> 8)) * 16777619u;
+#endif
+		traceDue = 0;
+	}
+}
+
+/* Keep count of the cycles the firmware spends paused, and note when a
+ * program starts.
+ */
+static void hostTrackState(void) {
+	if ((lastState == STATE_IDLE || lastState == STATE_FINISHED)
+		&& state != STATE_IDLE && state != STATE_FINISHED) {
+		programStart = cycles;
+	}
+	lastState = state;
+#ifdef SPEED_CONTROL
+	// the drum only settles while the program runs
+	if (state < STATE_WASH || state > STATE_SPIN) {
+		targetSince = cycles;
+	}
+#endif
+	uint8_t paused = (state == STATE_PAUSED || state == STATE_ERROR);
+	if (paused && !pausedNow) {
+		pausedAt = cycles;
+	} else if (!paused && pausedNow) {
+		pausedCycles += cycles - pausedAt;
+	}
+	pausedNow = paused;
+}
+
+/* Move time on to the given cycle. */
+static void hostAdvance(uint64_t until) {
+#ifdef SPEED_CONTROL
+	hostMotorRun(until);
+#endif
+	cycles = until;
+}
+
+/* A button pin has changed: raise the pin change interrupt if the
+ * firmware has it enabled. Returns 1 if it did.
+ */
+static uint8_t hostPinChange(uint8_t pin) {
+	// PCINT24 + n is PDn, so the mask bits are the pin numbers
+	if ((PCICR & (1 << PCIE3)) == 0 || (PCMSK3 & (1 << pin)) == 0) {
+		return 0;
+	}
+	PCIFR = 0; // the host runs every ISR as soon as it is due
+	PCINT3_vect();
+	return 1;
+}
+
+void set_sleep_mode(uint8_t mode) {
+	sleepMode = mode;
+}
+
+/* Idle sleep ends at the next interrupt, which the driver raises next
+ * anyway. In power-down every clock but the watchdog's stops, so the
+ * timers and the USART stand still, and of the button interrupts only
+ * the pin change one is modelled as a wake-up: an INT0/INT1 edge cannot
+ * be detected without the I/O clock. A second in, wakePin is pressed:
+ * its pin change interrupt must wake the MCU. If the firmware left nothing
+ * that could, the wake is refused and counted, and the MCU carries on
+ * as if it had woken so the run can end.
+ */
+void sleep_cpu(void) {
+	if (sleepMode != SLEEP_MODE_PWR_DOWN) {
+		return;
+	}
+	powerDowns++;
+	hostAdvance(cycles + F_CPU);
+	timer2Due = 0; // Timer 2 carries on from where it stopped
+#ifdef SHELL
+	uartRxDue = 0; // and so does a character being received
+#endif
+	PIND |= (1 << wakePin);
+	releaseDue = cycles + F_CPU / 20;
+	if (!hostPinChange(wakePin)) {
+		printf("powered down with no wake-up for PIND%u (INT0/INT1 %s)\n", wakePin,
+			EIMSK & (1 << (wakePin - PIND2)) ? "edges cannot wake it" : "off");
+		wakeRefused++;
+	}
+}
+
+/* Run the firmware's main loop once, unless it is hung: it handles the
+ * events posted, then goes to sleep.
+ */
+static void hostMainLoop(void) {
+	if (!hung) {
+		processEvents();
+		enterSleep();
+	}
+}
+
+/* A program tick has been posted: let the firmware handle it. */
+static void hostTick(void) {
+	hostMainLoop();
+	hostTrackState();
+	ticks++;
+	traceDue = 1;
+	hostTrace();
+}
+
+/* 1 if an input due at the given cycle comes before every timer
+ * interrupt, and no later than the other modelled inputs.
+ */
+static int hostFirst(uint64_t due) {
+	return due != 0 && (motorDue == 0 || due < motorDue)
+		&& (timer1Due == 0 || due < timer1Due)
+		&& (timer2Due == 0 || due < timer2Due)
+#ifdef SPEED_CONTROL
+		&& (tachoDue == 0 || due <= tachoDue)
+#endif
+#ifdef LEVEL_ADC
+		&& (adcDue == 0 || due <= adcDue)
+#endif
+		&& (eepromDue == 0 || due <= eepromDue)
+#ifdef TELEMETRY
+		&& (uartDue == 0 || due <= uartDue)
+#endif
+#ifdef SHELL
+		&& (uartRxDue == 0 || due <= uartRxDue)
+#endif
+		&& (watchdogDue == 0 || due <= watchdogDue);
+}
+
+/* Fast forward to the next timer compare match and run its ISR, then
+ * let the firmware's main loop handle the events it posted.
+ * A timer that has just been started is scheduled one period from now;
+ * if Timer 1's clock was stopped with its interrupt enabled TCNT1 holds
+ * the counts it had reached, and it carries on from there.
+ * The motor PWM timer free-runs from reset, so its overflows fall on
+ * whole periods.
+ * Returns 1 for a program tick (from Timer 1, or from Timer 2 with
+ * MOTOR_PWM_TIMER1), 2 for any other Timer 2 interrupt, 3 for the motor
+ * PWM timer, 4 for a tacho pulse, 5 for an ADC conversion, 6 for the
+ * EEPROM being ready, 7 for a watchdog reset, 8 for the USART data
+ * register being empty, 9 for the USART receiving a character, 10 for
+ * the button that woke the MCU being released, or 0 if none of them is
+ * running.
+ */
+static uint8_t hostStep(void) {
+	uint64_t period0 = motorPeriod();
+	uint64_t period1 = timer1Period();
+	uint64_t period2 = timer2Period();
+#ifdef LEVEL_ADC
+	uint64_t periodAdc = adcPeriod();
+#endif
+
+	motorDue = period0 ? (cycles / period0 + 1) * period0 : 0;
+	if (period1 == 0) {
+		if (timer1Due != 0) {
+			timer1Paused = (TIMSK1 & (1 << OCIE1A)) != 0 && timer1Prescale() == 0;
+			if (timer1Paused) {
+				TCNT1 = (cycles - timer1Base) / timer1Prescaler;
+			}
+		} else if ((TIMSK1 & (1 << OCIE1A)) == 0) {
+			timer1Paused = 0;
+		}
+		timer1Due = 0;
+	} else if (timer1Due == 0) {
+		timer1Prescaler = timer1Prescale();
+		if (timer1Paused) {
+			timer1Base = cycles - (uint64_t)TCNT1 * timer1Prescaler;
+			timer1Paused = 0;
+		} else {
+			timer1Base = cycles;
+		}
+		timer1Due = timer1Base + period1;
+	}
+	if (period2 == 0) {
+		timer2Due = 0;
+	} else if (timer2Due == 0) {
+		timer2Due = cycles + period2;
+	}
+#ifdef LEVEL_ADC
+	if (periodAdc == 0) {
+		adcDue = 0;
+	} else if (adcDue == 0) {
+		adcDue = cycles + periodAdc;
+	}
+#endif
+	if ((EECR & (1 << EERIE)) == 0) {
+		eepromDue = 0;
+	} else {
+		eepromDue = eepromReady > cycles ? eepromReady : cycles;
+	}
+#ifdef TELEMETRY
+	if (uartPeriod() == 0 || (UCSR0B & (1 << UDRIE0)) == 0) {
+		uartDue = 0;
+	} else {
+		uartDue = uartReady > cycles ? uartReady : cycles;
+	}
+#endif
+#ifdef SHELL
+	if (uartPeriod() == 0 || (UCSR0B & ((1 << RXEN0) | (1 << RXCIE0))) != ((1 << RXEN0) | (1 << RXCIE0))
+		|| uartInputTail == uartInputHead) {
+		uartRxDue = 0;
+	} else if (uartRxDue == 0) {
+		// received once its stop bit is in
+		uartRxDue = (uartRxReady > cycles ? uartRxReady : cycles) + uartPeriod();
+	}
+#endif
+	watchdogDue = watchdogPeriod ? watchdogFed + watchdogPeriod : 0;
+	if (hostFirst(watchdogDue)) {
+		watchdogWentOff = watchdogDue;
+		hostReset(PIND, 1 << WDRF);
+		return 7;
+	}
+	if (hostFirst(releaseDue)) {
+		hostAdvance(releaseDue);
+		releaseDue = 0;
+		PIND &= ~(1 << wakePin);
+		hostPinChange(wakePin);
+		return 10;
+	}
+#ifdef SPEED_CONTROL
+	/* Input capture latches TCNT1 on each tacho pulse, even with the
+	 * clock stopped. Pulses that coincide with a timer interrupt are
+	 * left until after it.
+	 */
+	tachoDue = hostTachoDue();
+	if (hostFirst(tachoDue)) {
+		hostAdvance(tachoDue);
+		if ((TIMSK1 & (1 << ICIE1)) && (PRR0 & (1 << PRTIM1)) == 0) {
+			ICR1 = timer1Due ? (cycles - timer1Base) / timer1Prescaler : TCNT1;
+			TIFR1 = 0; // the host runs every ISR as soon as it is due
+			TIMER1_CAPT_vect();
+		}
+		return 4;
+	}
+#endif
+#ifdef LEVEL_ADC
+	if (hostFirst(adcDue)) {
+		hostAdvance(adcDue);
+		adcDue += periodAdc;
+		ADC = hostLevelConversion();
+		ADC_vect();
+		return 5;
+	}
+#endif
+	if (hostFirst(eepromDue)) {
+		hostAdvance(eepromDue);
+		EE_READY_vect();
+		if (EECR & (1 << EEPE)) {
+			eeprom[EEAR & (sizeof(eeprom) - 1)] = EEDR;
+			EECR &= ~((1 << EEMPE) | (1 << EEPE));
+			eepromReady = cycles + EEPROM_WRITE_CYCLES;
+		}
+		return 6;
+	}
+#ifdef TELEMETRY
+	if (hostFirst(uartDue)) {
+		hostAdvance(uartDue);
+		UDR0 = UART_EMPTY;
+		USART0_UDRE_vect();
+		if (UDR0 != UART_EMPTY) {
+			telemetryBytes++;
+			telemetryFrames += (UDR0 == 0);
+			if (telemetryFile != NULL) {
+				fputc(UDR0, telemetryFile);
+			}
+#ifdef SHELL
+			if (ptyFd >= 0) {
+				uint8_t byte = UDR0;
+				if (write(ptyFd, &byte, 1) != 1) {
+					; // nobody is reading the pseudo-terminal
+				}
+			}
+#endif
+			uartReady = cycles + uartPeriod();
+		}
+		return 8;
+	}
+#endif
+#ifdef SHELL
+	if (hostFirst(uartRxDue)) {
+		// the interrupt wakes the main loop
+		hostAdvance(uartRxDue);
+		uartRxReady = cycles;
+		uartRxDue = 0;
+		UDR0 = uartInput[uartInputTail++];
+		UCSR0A |= (1 << RXC0);
+		USART0_RX_vect();
+		UCSR0A &= ~(1 << RXC0);
+		hostMainLoop();
+		hostTrackState();
+		return 9;
+	}
+#endif
+	if (motorDue != 0 && (timer1Due == 0 || motorDue <= timer1Due)
+		&& (timer2Due == 0 || motorDue <= timer2Due)) {
+		hostAdvance(motorDue);
+		MOTOR_OVF_vect();
+		hostTrace();
+		return 3;
+	}
+	if (timer1Due != 0 && (timer2Due == 0 || timer1Due <= timer2Due)) {
+		/* In CTC mode the ISR sets OCR1A for the tick that has just
+		 * begun, so the next compare match is scheduled afterwards.
+		 */
+		hostAdvance(timer1Due);
+		timer1Base = timer1Due;
+#ifndef MOTOR_PWM_TIMER1
+		TIMER1_COMPA_vect();
+#endif
+		timer1Due += timer1Period();
+		hostTick();
+		return 1;
+	}
+	if (timer2Due != 0) {
+#ifdef MOTOR_PWM_TIMER1
+		// the ISR posts a tick when the last refresh of one is counted
+		uint8_t tick = tickRunning && tickCountdown == 1;
+#else
+		uint8_t tick = 0;
+#endif
+		hostAdvance(timer2Due);
+		timer2Due += period2;
+		TIMER2_COMPA_vect();
+		if (tick) {
+			hostTick();
+			return 1;
+		}
+		hostMainLoop();
+		hostTrackState();
+		hostTrace();
+		return 2;
+	}
+	return 0;
+}
+
+/* Press the start (B0, PIND2) or reset (B1, PIND3) button and hold it
+ * for 50 ms. The press and the release raise the pin change interrupt
+ * if the firmware has it enabled; the press itself is picked up by the
+ * firmware's debouncing.
+ */
+static void hostPress(uint8_t pin) {
+	uint64_t release = cycles + F_CPU / 20;
+	PIND |= (1 << pin);
+	if (hostPinChange(pin)) {
+		hostMainLoop();
+	}
+	while (cycles < release && hostStep() != 0) {
+		;
+	}
+	PIND &= ~(1 << pin);
+	hostPinChange(pin);
+}
+
+/* Let the firmware run on its own for the given number of cycles. */
+static void hostWait(uint64_t length) {
+	uint64_t until = cycles + length;
+	while (cycles < until && hostStep() != 0) {
+		;
+	}
+}
+
+/* Check every entry of the firmware's transition table: each must name
+ * a real state and action, EVENT_NONE must change nothing, reset must
+ * lead back to idle from everywhere and every state must be reachable
+ * from idle. Returns the number of problems found.
+ */
+static int checkTransitions(void) {
+	uint8_t reached[STATE_COUNT] = {1};
+	int problems = 0;
+	int grew = 1;
+	int s, e;
+
+	for (s = 0; s < STATE_COUNT; s++) {
+		for (e = 0; e < EVENT_COUNT; e++) {
+			const struct transition *t = &transitions[s][e];
+			if (t->next >= STATE_COUNT || t->action >= ACTION_COUNT) {
+				printf("transition [%d][%d]: bad state %u or action %u\n", s, e, t->next, t->action);
+				problems++;
+			}
+		}
+		if (transitions[s][EVENT_NONE].next != s || transitions[s][EVENT_NONE].action != ACTION_NONE) {
+			printf("transition [%d][NONE]: must leave the state alone\n", s);
+			problems++;
+		}
+		if (transitions[s][EVENT_RESET].next != STATE_IDLE) {
+			printf("transition [%d][RESET]: does not return to idle\n", s);
+			problems++;
+		}
+	}
+	while (grew) {
+		grew = 0;
+		for (s = 0; s < STATE_COUNT; s++) {
+			for (e = 0; reached[s] && e < EVENT_COUNT; e++) {
+				uint8_t next = transitions[s][e].next;
+				if (next < STATE_COUNT && !reached[next]) {
+					reached[next] = 1;
+					grew = 1;
+				}
+			}
+		}
+	}
+	for (s = 0; s < STATE_COUNT; s++) {
+		if (!reached[s]) {
+			printf("state %d: unreachable from idle\n", s);
+			problems++;
+		}
+	}
+	printf("transition table: %d states x %d events, %d problems\n",
+		STATE_COUNT, EVENT_COUNT, problems);
+	return problems;
+}
+
+/* One wash scenario: switch inputs on PIND, then press start and run
+ * until the firmware reports finished (or the program timer stops).
+ * If pauseTick is set, start is pressed again after that many ticks to
+ * pause the program and once more pauseLength cycles later to resume.
+ * If switchTick is set, the switches are changed to switchPind after
+ * that many ticks. If cutTick is set, the power is cut 10 ms after that
+ * many ticks and the MCU boots again, with the EEPROM as it was left.
+ * If hangTick is set, the main loop hangs after that many ticks, until
+ * the watchdog resets the MCU. Ticks and the timings only count from
+ * such a reboot. If shellTick is set (SHELL only), shellLine is typed
+ * into the USART after that many ticks, and the firmware must then be
+ * in shellState. If user is set (USER_PROGRAMS only), userProgram is
+ * uploaded for the mode selected before start is pressed. If idle is
+ * set, the firmware is left idle for that many cycles instead of start
+ * being pressed at once; long enough, and it powers down, to be woken
+ * by the start press that also starts the program.
+ */
+struct scenario {
+	const char *name;
+	uint8_t pind;
+	uint16_t pauseTick;
+	uint64_t pauseLength;
+	uint16_t switchTick;
+	uint8_t switchPind;
+	uint8_t load; /* percent of the motor's torque the drum load takes (SPEED_CONTROL) */
+	uint16_t loadTick; /* tick the load is put on from (0 = from the start) */
+	uint16_t cutTick;
+	uint16_t hangTick;
+	uint16_t shellTick;
+	const char *shellLine;
+	uint8_t shellState;
+	uint8_t user;
+	uint64_t idle;
+	uint16_t ticks;
+	uint64_t cycles;
+	uint64_t duration; /* cycles from starting the program to its end */
+	uint32_t trace; /* FNV-1a hash of every PORTC/motor compare output */
+	uint64_t paused; /* cycles spent paused */
+	uint8_t finished;
+	uint16_t resumed; /* program clock the program carried on from after the power cut or hang */
+	uint8_t watchdogResets;
+	uint64_t hung; /* cycles from the main loop hanging to the watchdog reset */
+	uint8_t shellOk; /* the command worked, with no error or character dropped */
+	uint8_t userOk; /* the user program was uploaded and saved */
+	uint16_t powerDowns;
+	uint16_t wakeRefused; /* power-downs with nothing that could wake the MCU */
+};
+
+#ifdef SHELL
+/* Type a line into the USART, ended with a carriage return. */
+static void hostType(const char *line) {
+	while (*line != 0) {
+		uartInput[uartInputHead++] = *line++;
+	}
+	uartInput[uartInputHead++] = '\r';
+}
+#endif
+
+#ifdef USER_PROGRAMS
+/* Upload userProgram for the given mode, a line at a time, waiting
+ * 20 ms for each to be run. Returns 1 if every line worked.
+ */
+static uint8_t hostUpload(uint8_t mode) {
+	uint8_t errors = shellErrors;
+	char line[48];
+	size_t i, length = 0;
+
+	snprintf(line, sizeof(line), "edit %u", mode);
+	hostType(line);
+	hostWait(F_CPU / 50);
+	for (i = 0; i < sizeof(userProgram); i++) {
+		if (i % 8 == 0) {
+			length = snprintf(line, sizeof(line), "code");
+		}
+		length += snprintf(line + length, sizeof(line) - length, " %u", userProgram[i]);
+		if (i % 8 == 7 || i == sizeof(userProgram) - 1) {
+			hostType(line);
+			hostWait(F_CPU / 50);
+		}
+	}
+	hostType("save");
+	hostWait(F_CPU / 50);
+	return shellErrors == errors && shellDropped == 0;
+}
+#endif
+
+static void runScenario(struct scenario *s) {
+	uint8_t cut = 0;
+	uint64_t hangAt = 0;
+	uint8_t step;
+	memset(eeprom, 0xFF, sizeof(eeprom)); // erased, as a new part
+#ifdef SHELL
+	memcpy(pwm, pwmBuilt, sizeof(pwm));
+	s->shellOk = 0;
+#endif
+	s->resumed = 0;
+	s->watchdogResets = 0;
+	s->hung = 0;
+	powerDowns = wakeRefused = 0;
+	hostReset(s->pind, 1 << PORF);
+#ifdef SPEED_CONTROL
+	drumLoad = s->loadTick ? 0 : s->load / 100.0;
+#endif
+#ifdef USER_PROGRAMS
+	s->userOk = s->user ? hostUpload((s->pind >> PIND4) & 1) : 0;
+#endif
+	if (s->idle != 0) {
+		hostWait(s->idle);
+	} else {
+		hostPress(PIND2);
+	}
+	while (state != STATE_IDLE && state != STATE_FINISHED) {
+		step = hostStep();
+		if (step == 7) {
+			s->watchdogResets++;
+			s->resumed = programClock();
+			s->hung = watchdogWentOff - hangAt;
+		}
+		if (step != 1) {
+			continue;
+		}
+		if (s->pauseTick != 0 && ticks == s->pauseTick) {
+			hostPress(PIND2);
+			hostWait(s->pauseLength);
+			hostPress(PIND2);
+		}
+		if (s->switchTick != 0 && ticks == s->switchTick) {
+			PIND = s->switchPind;
+		}
+		if (s->cutTick != 0 && ticks == s->cutTick && !cut) {
+			hostWait(F_CPU / 100);
+			hostReset(s->pind, 1 << PORF);
+			s->resumed = programClock();
+			cut = 1;
+		}
+		if (s->hangTick != 0 && ticks == s->hangTick && !cut) {
+			hung = 1;
+			hangAt = cycles;
+			cut = 1;
+		}
+#ifdef SHELL
+		if (s->shellTick != 0 && ticks == s->shellTick) {
+			uint8_t errors = shellErrors;
+			hostType(s->shellLine);
+			hostWait(F_CPU / 50); // 20 ms, for the line, the command and its reply
+			s->shellOk = (shellErrors == errors && shellDropped == 0 && state == s->shellState);
+		}
+#endif
+#ifdef SPEED_CONTROL
+		if (s->loadTick != 0 && ticks == s->loadTick) {
+			drumLoad = s->load / 100.0;
+			targetSince = cycles; // give the loop time to recover
+		}
+#endif
+	}
+	s->ticks = ticks;
+	s->cycles = cycles;
+	s->duration = ticks ? cycles - programStart : 0;
+	s->trace = trace;
+	s->paused = pausedCycles;
+	s->finished = (state == STATE_FINISHED);
+	s->powerDowns = powerDowns;
+	s->wakeRefused = wakeRefused;
+#ifdef TELEMETRY
+	// send the frames still queued, down to the one for the program finishing
+	while ((UCSR0B & (1 << UDRIE0)) && hostStep() != 0) {
+		;
+	}
+	telemetryDropped += telemetryLost;
+	telemetryLost = 0;
+#endif
+#ifdef LEVEL_ADC
+	if (levelQuantized != (s->pind & 3)) {
+		printf("%s: water level read as %u (fine %u)\n", s->name, levelQuantized, levelFine);
+		levelErrors++;
+	}
+#endif
+}
+
+#ifdef SHELL
+/* Run the firmware in real time, with the given switches, and its USART
+ * on a new pseudo-terminal, until interrupted. There are no buttons to
+ * press: the shell's start and reset commands stand in for them. The
+ * shell cannot wake the MCU from power-down, though, so reset is pressed
+ * a second after the firmware powers down.
+ */
+static int hostPty(uint8_t pind) {
+	struct termios raw;
+	struct timespec start, now;
+	int slave = -1;
+	uint8_t c;
+
+	ptyFd = posix_openpt(O_RDWR | O_NOCTTY);
+	if (ptyFd < 0 || grantpt(ptyFd) != 0 || unlockpt(ptyFd) != 0
+		|| (slave = open(ptsname(ptyFd), O_RDWR | O_NOCTTY)) < 0) {
+		perror("pseudo-terminal");
+		return 1;
+	}
+	// raw, so the frames go through as they are; the slave is kept open
+	// so the pseudo-terminal stays up between the programs using it
+	tcgetattr(slave, &raw);
+	cfmakeraw(&raw);
+	tcsetattr(slave, TCSANOW, &raw);
+	fcntl(ptyFd, F_SETFL, O_NONBLOCK);
+	printf("USART0 on %s\n", ptsname(ptyFd));
+	fflush(stdout);
+
+	memset(eeprom, 0xFF, sizeof(eeprom));
+	wakePin = PIND3;
+	hostReset(pind, 1 << PORF);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (;;) {
+		uint64_t elapsed;
+		uint8_t step;
+		while ((uint8_t)(uartInputHead + 1) != uartInputTail && read(ptyFd, &c, 1) == 1) {
+			uartInput[uartInputHead++] = c;
+		}
+		step = hostStep();
+		if (step == 0) {
+			return 1;
+		}
+		if (step == 7) {
+			printf("watchdog reset\n");
+			clock_gettime(CLOCK_MONOTONIC, &start); // cycles count from the reset
+		}
+		// keep the simulated time within a millisecond of real time
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		elapsed = (uint64_t)(now.tv_sec - start.tv_sec) * 1000000000 + now.tv_nsec - start.tv_nsec;
+		if (cycles * 1000000000 / F_CPU > elapsed + 1000000) {
+			struct timespec wait = {0, cycles * 1000000000 / F_CPU - elapsed};
+			nanosleep(&wait, NULL);
+		}
+	}
+}
+#endif
+
+int main(int argc, char **argv) {
+	struct scenario scenarios[] = {
+		{.name = "normal-level0", .pind = 0x00},
+		{.name = "normal-level1", .pind = 0x01},
+		{.name = "normal-level2", .pind = 0x02},
+		{.name = "normal-error", .pind = 0x03},
+		{.name = "extended-level0", .pind = 0x10},
+		{.name = "extended-level1", .pind = 0x11},
+		{.name = "extended-level2", .pind = 0x12},
+		{.name = "extended-error", .pind = 0x13},
+		{.name = "normal-pause", .pind = 0x00, .pauseTick = 40, .pauseLength = F_CPU * 2},
+		{.name = "extended-pause", .pind = 0x10, .pauseTick = 100, .pauseLength = F_CPU * 5},
+		/* the program latched at start runs on whatever the mode switch does */
+		{.name = "normal-switch", .pind = 0x00, .switchTick = 40, .switchPind = 0x10},
+		{.name = "extended-switch", .pind = 0x10, .switchTick = 100, .switchPind = 0x00},
+		/* a power cut just after a checkpoint is made, while it is being
+		 * written, and one part way between two checkpoints
+		 */
+		{.name = "normal-cut", .pind = 0x00, .cutTick = 48},
+		{.name = "extended-cut", .pind = 0x10, .cutTick = 71},
+		/* the main loop hanging part way through a program */
+		{.name = "normal-hang", .pind = 0x00, .hangTick = 50},
+		{.name = "extended-hang", .pind = 0x10, .hangTick = 100},
+		/* left idle past the firmware's 30 s timeout before start is pressed */
+		{.name = "normal-idle", .pind = 0x00, .idle = F_CPU * 32},
+#ifdef SHELL
+		/* commands from the shell: forcing the spin phase, setting the
+		 * rinse duty to another pwm[] level, and a query
+		 */
+		{.name = "normal-phase", .pind = 0x00, .shellTick = 10, .shellLine = "phase 2", .shellState = STATE_SPIN},
+		{.name = "extended-duty", .pind = 0x10, .shellTick = 5, .shellLine = "duty 1 90", .shellState = STATE_WASH},
+		{.name = "normal-counters", .pind = 0x00, .shellTick = 20, .shellLine = "counters", .shellState = STATE_WASH},
+#endif
+#ifdef USER_PROGRAMS
+		/* an uploaded program in place of the built-in one: on its own,
+		 * through a power cut and a hang part way round its loop, and
+		 * jumped to a phase in its loop from the shell
+		 */
+		{.name = "normal-user", .pind = 0x00, .user = 1},
+		{.name = "extended-user", .pind = 0x10, .user = 1},
+		{.name = "normal-user-cut", .pind = 0x00, .cutTick = 50, .user = 1},
+		{.name = "normal-user-hang", .pind = 0x00, .hangTick = 70, .user = 1},
+		{.name = "normal-user-jump", .pind = 0x00, .shellTick = 10, .shellLine = "phase 4", .shellState = STATE_SPIN, .user = 1},
+#endif
+#ifdef SPEED_CONTROL
+		/* the speed loop must make up for a loaded drum, and for the
+		 * load changing part way through a phase
+		 */
+		{.name = "normal-load", .pind = 0x00, .load = 20},
+		{.name = "extended-load", .pind = 0x10, .pauseTick = 40, .pauseLength = F_CPU, .load = 15, .loadTick = 110},
+#endif
+	};
+	const int count = sizeof(scenarios) / sizeof(scenarios[0]);
+	long iterations;
+	struct timespec start, end;
+	double seconds;
+	int status = 0;
+	int i;
+
+#ifdef SHELL
+	memcpy(pwmBuilt, pwm, sizeof(pwm));
+	if (argc > 1 && strcmp(argv[1], "pty") == 0) {
+		return hostPty(argc > 2 ? strtoul(argv[2], NULL, 16) : 0);
+	}
+#endif
+	iterations = argc > 1 ? atol(argv[1]) : 10000;
+	if (checkTransitions() != 0) {
+		status = 1;
+	}
+#ifdef TELEMETRY
+	if (argc > 2 && (telemetryFile = fopen(argv[2], "wb")) == NULL) {
+		perror(argv[2]);
+		return 1;
+	}
+#endif
+	for (i = 0; i < count; i++) {
+		runScenario(&scenarios[i]);
+		int64_t error = scenarios[i].duration - scenarios[i].paused - SPEC_TICK_CYCLES(scenarios[i].ticks);
+		uint16_t cut = scenarios[i].cutTick;
+		uint16_t hang = scenarios[i].hangTick;
+		/* the tick accumulator only comes out exact over whole periods of
+		 * 16 ticks, which carrying on after a reset or jumping to another
+		 * phase can leave part done
+		 */
+		uint8_t shifted = scenarios[i].paused || scenarios[i].ticks % 16 != 0;
+#ifdef MOTOR_PWM_TIMER1
+		/* pausing shifts the tick by up to a display refresh */
+		int64_t allowed = shifted ? (int64_t)timer2Period() : 1;
+#else
+		/* pausing loses the part of a Timer 1 count in progress */
+		int64_t allowed = shifted ? timer1Prescaler : 1;
+#endif
+		printf("%-16s ticks=%3u sim=%7.3fs program=%10llu cycles (error %lld) paused=%llu finished=%u trace=%08x\n",
+			scenarios[i].name, scenarios[i].ticks,
+			(double)scenarios[i].cycles / F_CPU,
+			(unsigned long long)scenarios[i].duration, (long long)error,
+			(unsigned long long)scenarios[i].paused,
+			scenarios[i].finished, scenarios[i].trace);
+		/* a finished program must match the specified tick rate (plus any pause) to the cycle */
+		if (scenarios[i].finished && (error > allowed || error < -allowed)) {
+			status = 1;
+		}
+		/* after a power cut the program must finish, carrying on from the
+		 * last checkpoint and running the rest of its ticks (as the
+		 * scenario with the same switches and no cut, first in the list)
+		 * without pausing
+		 */
+		if (cut != 0) {
+			int j = 0;
+			while (scenarios[j].pind != scenarios[i].pind || scenarios[j].user != scenarios[i].user) {
+				j++;
+			}
+			printf("%-16s power cut at tick %u, carried on from tick %u\n",
+				scenarios[i].name, cut, scenarios[i].resumed);
+			if (!scenarios[i].finished || scenarios[i].paused != 0 || scenarios[i].resumed > cut
+				|| cut - scenarios[i].resumed > CHECKPOINT_TICKS
+				|| scenarios[i].resumed + scenarios[i].ticks != scenarios[j].ticks) {
+				status = 1;
+			}
+		}
+		/* the watchdog must only go off in the scenarios that hang, and
+		 * the program must then carry on from the tick it had reached,
+		 * without pausing
+		 */
+		if (hang != 0) {
+			int j = 0;
+			while (scenarios[j].pind != scenarios[i].pind || scenarios[j].user != scenarios[i].user) {
+				j++;
+			}
+			printf("%-16s hung at tick %u, watchdog reset %.0f ms later, carried on from tick %u\n",
+				scenarios[i].name, hang, scenarios[i].hung * 1000.0 / F_CPU, scenarios[i].resumed);
+			if (!scenarios[i].finished || scenarios[i].paused != 0 || scenarios[i].watchdogResets != 1
+				|| scenarios[i].hung > watchdogPeriod || scenarios[i].resumed != hang
+				|| scenarios[i].resumed + scenarios[i].ticks != scenarios[j].ticks) {
+				status = 1;
+			}
+		} else if (scenarios[i].watchdogResets != 0) {
+			printf("%s: %u watchdog resets\n", scenarios[i].name, scenarios[i].watchdogResets);
+			status = 1;
+		}
+		/* the firmware must power down once it has been idle long enough,
+		 * and nowhere else, and the button press must wake it
+		 */
+		if (scenarios[i].idle != 0) {
+			printf("%-16s idle %.0f s, powered down %u times, %u wake-ups refused\n",
+				scenarios[i].name, (double)scenarios[i].idle / F_CPU,
+				scenarios[i].powerDowns, scenarios[i].wakeRefused);
+		}
+		if (scenarios[i].powerDowns != (scenarios[i].idle != 0) || scenarios[i].wakeRefused != 0
+			|| (scenarios[i].idle != 0 && !scenarios[i].finished)) {
+			status = 1;
+		}
+#ifdef USER_PROGRAMS
+		/* a user program must run for the ticks it was written for */
+		if (scenarios[i].user) {
+			printf("%-16s user program %s\n", scenarios[i].name,
+				scenarios[i].userOk ? "uploaded" : "failed to upload");
+			if (!scenarios[i].userOk || !scenarios[i].finished
+				|| (cut == 0 && hang == 0 && scenarios[i].shellTick == 0 && scenarios[i].ticks != USER_PROGRAM_TICKS)) {
+				status = 1;
+			}
+		}
+#endif
+#ifdef SHELL
+		if (scenarios[i].shellTick != 0) {
+			printf("%-16s \"%s\" at tick %u %s\n", scenarios[i].name, scenarios[i].shellLine,
+				scenarios[i].shellTick, scenarios[i].shellOk ? "worked" : "failed");
+			if (!scenarios[i].finished || !scenarios[i].shellOk) {
+				status = 1;
+			}
+		}
+#endif
+	}
+#ifdef LEVEL_ADC
+	printf("water level: %d scenarios, %lu read wrong through +/-%d counts of noise\n",
+		count, levelErrors, LEVEL_NOISE);
+	if (levelErrors != 0) {
+		status = 1;
+	}
+#endif
+#ifdef TELEMETRY
+	printf("telemetry: %lu bytes in %lu frames, %lu dropped\n",
+		telemetryBytes, telemetryFrames, telemetryDropped);
+	if (telemetryDropped != 0 || telemetryFrames == 0) {
+		status = 1;
+	}
+	if (telemetryFile != NULL) {
+		fclose(telemetryFile);
+		telemetryFile = NULL;
+	}
+#endif
+#ifdef SPEED_CONTROL
+	printf("drum speed: %lu ticks checked, %lu out by more than %.0f%%, worst %.1f%%\n",
+		speedChecks, speedErrors, SPEED_TOLERANCE * 100, speedWorst * 100);
+	if (speedErrors != 0 || speedChecks == 0) {
+		status = 1;
+	}
+#else
+	printf("motor duty: %lu outputs checked, %lu not at a pwm[] level, resolution 1/%u\n",
+		dutyChecks, dutyErrors, (unsigned)MOTOR_PWM_COUNTS);
+	if (dutyErrors != 0) {
+		status = 1;
+	}
+#endif
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (long n = 0; n < iterations; n++) {
+		runScenario(&scenarios[n % count]);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("%ld scenarios in %.3fs (%.0f scenarios/s)\n",
+		iterations, seconds, iterations / seconds);
+	return status;
+}
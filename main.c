@@ -5,81 +5,1331 @@
  * Author : william.barker
  */ 
 
-#include <avr/io.h>
-#include <avr/interrupt.h>
-#include <stdint.h>
+#include "hal.h"
+// LED pattern tables, generated from sim/gen_patterns.c
+#include "patterns.h"
+// states, events and actions
+#include "statemachine.h"
+// telemetry frame format
+#include "telemetry.h"
+// user program bytecode
+#include "bytecode.h"
+/* Seven segment refresh rate. Timer 2 interrupts DISPLAY_REFRESH_HZ
+ * times a second and each interrupt shows the next digit, so each
+ * digit is refreshed at half this rate.
+ */
+#define DISPLAY_REFRESH_HZ 1000
+#define DISPLAY_PRESCALER 64
+#define DISPLAY_OCR (F_CPU / DISPLAY_PRESCALER / DISPLAY_REFRESH_HZ - 1)
+#if DISPLAY_OCR < 1 || DISPLAY_OCR > 255
+#error "DISPLAY_REFRESH_HZ cannot be reached with DISPLAY_PRESCALER"
+#endif
+// Timer 2 clock select bits for DISPLAY_PRESCALER
+#if DISPLAY_PRESCALER == 1
+#define DISPLAY_CS ((0 << CS22) | (0 << CS21) | (1 << CS20))
+#elif DISPLAY_PRESCALER == 8
+#define DISPLAY_CS ((0 << CS22) | (1 << CS21) | (0 << CS20))
+#elif DISPLAY_PRESCALER == 32
+#define DISPLAY_CS ((0 << CS22) | (1 << CS21) | (1 << CS20))
+#elif DISPLAY_PRESCALER == 64
+#define DISPLAY_CS ((1 << CS22) | (0 << CS21) | (0 << CS20))
+#elif DISPLAY_PRESCALER == 128
+#define DISPLAY_CS ((1 << CS22) | (0 << CS21) | (1 << CS20))
+#elif DISPLAY_PRESCALER == 256
+#define DISPLAY_CS ((1 << CS22) | (1 << CS21) | (0 << CS20))
+#elif DISPLAY_PRESCALER == 1024
+#define DISPLAY_CS ((1 << CS22) | (1 << CS21) | (1 << CS20))
+#else
+#error "DISPLAY_PRESCALER must be a Timer 2 prescaler"
+#endif
+
+/* Motor PWM and program tick timers, chosen at compile time. By default
+ * the motor is driven by Timer 0 in 8-bit fast PWM on OC0B and Timer 1
+ * times the program ticks. Defining MOTOR_PWM_TIMER1 drives the motor
+ * from Timer 1 instead, in phase correct PWM on OC1A (PD5) with
+ * MOTOR_TOP steps of resolution (10 - 16 bits), and counts the program
+ * ticks in display refreshes on Timer 2.
+ * The motor duty is inverted in both: the output is set on compare
+ * match, so MOTOR_TOP is off.
+ */
+#ifdef MOTOR_PWM_TIMER1
+#define MOTOR_TOP 1023U // 10-bit, 3.9 kHz with no prescaling
+#if MOTOR_TOP < 1023 || MOTOR_TOP > 65535
+#error "MOTOR_TOP must give 10 - 16 bits of resolution"
+#endif
+typedef uint16_t motor_t;
+typedef uint32_t motorProduct_t;
+#define MOTOR_OCR OCR1A
+#define MOTOR_OVF_vect TIMER1_OVF_vect
+#define MOTOR_TIMSK TIMSK1
+#define MOTOR_TOIE TOIE1
+#define MOTOR_TIFR TIFR1
+#define MOTOR_TOV TOV1
+// phase correct PWM counts up to TOP and back down again
+#define MOTOR_PERIOD_CYCLES (2UL * MOTOR_TOP)
+#define RAMP_PERIODS 256UL // 65.5 ms at 8 MHz
+#else
+#define MOTOR_TOP 255U
+typedef uint8_t motor_t;
+typedef uint16_t motorProduct_t;
+#define MOTOR_OCR OCR0B
+#define MOTOR_OVF_vect TIMER0_OVF_vect
+#define MOTOR_TIMSK TIMSK0
+#define MOTOR_TOIE TOIE0
+#define MOTOR_TIFR TIFR0
+#define MOTOR_TOV TOV0
+#define MOTOR_PERIOD_CYCLES 256UL
+#define RAMP_PERIODS 2048UL // 65.5 ms at 8 MHz
+#endif
+// motor compare value for a duty cycle in percent
+#define MOTOR_DUTY(percent) (MOTOR_TOP - MOTOR_TOP * (percent) / 100)
+
+/* Program tick rate: TICKS_PER_PERIOD ticks every TICK_PERIOD_MS.
+ * Ticks are counted in TICK_COUNTS counts per period: Timer 1 counts in
+ * CTC mode at F_CPU / TICK_PRESCALER, or with MOTOR_PWM_TIMER1 the
+ * counts are display refreshes. That rarely divides exactly into
+ * ticks (16 ticks in 3 s at 8 MHz / 256 is 5859.375 counts each), so
+ * every tick is TICK_BASE counts and TICK_REMAINDER ticks per period
+ * are one count longer. The long ticks are spread out by a fractional
+ * accumulator, so the program timing never drifts.
+ */
+#define TICK_PERIOD_MS 3000UL
+#define TICKS_PER_PERIOD 16
+#ifdef MOTOR_PWM_TIMER1
+#define TICK_COUNTS (TICK_PERIOD_MS * DISPLAY_REFRESH_HZ / 1000)
+#if (TICK_PERIOD_MS * DISPLAY_REFRESH_HZ) % 1000 != 0
+#error "TICK_PERIOD_MS is not a whole number of display refreshes"
+#endif
+#else
+#define TICK_PRESCALER 256
+#define TICK_COUNTS (F_CPU / 1000 * TICK_PERIOD_MS / TICK_PRESCALER)
+#if (F_CPU / 1000 * TICK_PERIOD_MS) % TICK_PRESCALER != 0
+#error "TICK_PERIOD_MS is not a whole number of Timer 1 counts"
+#endif
+#endif
+#define TICK_BASE (TICK_COUNTS / TICKS_PER_PERIOD)
+#define TICK_REMAINDER (TICK_COUNTS % TICKS_PER_PERIOD)
+#if TICK_BASE < 2 || TICK_BASE > 65535
+#error "TICK_PERIOD_MS / TICKS_PER_PERIOD out of range for the tick counts"
+#endif
+/* Converts a duration in seconds to program ticks, so programs can be
+ * written independently of the tick rate. The result must fit the
+ * 16-bit program clock (about 3.4 hours at 16 ticks every 3 s).
+ */
+#define TICKS_FROM_SECONDS(seconds) ((uint16_t)((seconds) * 1000UL * TICKS_PER_PERIOD / TICK_PERIOD_MS))
+#ifndef MOTOR_PWM_TIMER1
+// Timer 1 clock select bits for TICK_PRESCALER
+#if TICK_PRESCALER == 1
+#define TICK_CS ((0 << CS12) | (0 << CS11) | (1 << CS10))
+#elif TICK_PRESCALER == 8
+#define TICK_CS ((0 << CS12) | (1 << CS11) | (0 << CS10))
+#elif TICK_PRESCALER == 64
+#define TICK_CS ((0 << CS12) | (1 << CS11) | (1 << CS10))
+#elif TICK_PRESCALER == 256
+#define TICK_CS ((1 << CS12) | (0 << CS11) | (0 << CS10))
+#elif TICK_PRESCALER == 1024
+#define TICK_CS ((1 << CS12) | (0 << CS11) | (1 << CS10))
+#else
+#error "TICK_PRESCALER must be a Timer 1 prescaler"
+#endif
+#endif
+
+/* Motor soft start. Whenever the duty changes, the motor compare value
+ * follows rampCurve from the old level to the new one over RAMP_PERIODS
+ * PWM periods (motor timer overflows, MOTOR_PERIOD_CYCLES each), moving
+ * one curve step every RAMP_PERIODS / RAMP_STEPS periods.
+ */
+#define RAMP_PERIODS_PER_STEP (RAMP_PERIODS / RAMP_STEPS)
+#if RAMP_PERIODS % RAMP_STEPS != 0 || RAMP_PERIODS_PER_STEP < 1 || RAMP_PERIODS_PER_STEP > 255
+#error "RAMP_PERIODS must be 1 - 255 times RAMP_STEPS"
+#endif
+// a ramp must finish within a tick, so every tick's outputs are reached
+#if RAMP_PERIODS * MOTOR_PERIOD_CYCLES * TICKS_PER_PERIOD >= F_CPU / 1000 * TICK_PERIOD_MS
+#error "RAMP_PERIODS is longer than a program tick"
+#endif
+
+/* Closed loop drum speed control, built in when SPEED_CONTROL is
+ * defined. A tacho on ICP1 (PD6) gives TACHO_PULSES_PER_REV pulses per
+ * drum revolution; Timer 1 input capture timestamps them, and the time
+ * between two pulses gives the drum speed. SPEED_CONTROL_HZ times a
+ * second a PI(D) controller moves the motor duty to bring the speed to
+ * the target of the current phase. The gains are in 256ths of a PWM
+ * count per rpm (per rpm per iteration for SPEED_KI); the output starts
+ * from the phase's open loop pwm[] level and moves at most SPEED_SLEW
+ * counts per iteration, which also soft-starts the motor.
+ * Input capture needs Timer 1 counting the ticks, so this cannot be
+ * combined with MOTOR_PWM_TIMER1.
+ */
+#ifdef SPEED_CONTROL
+#ifdef MOTOR_PWM_TIMER1
+#error "SPEED_CONTROL needs Timer 1 input capture, which MOTOR_PWM_TIMER1 uses for the motor"
+#endif
+#define TACHO_PULSES_PER_REV 8
+// rpm times the Timer 1 counts between two tacho pulses
+#define TACHO_RPM_COUNTS (60UL * F_CPU / TICK_PRESCALER / TACHO_PULSES_PER_REV)
+// pulse period taken as a stopped drum (about 0 rpm)
+#define TACHO_STOPPED 0xFFFF
+// shortest pulse period whose speed fits 16 bits; shorter ones are glitches
+#define TACHO_MIN_PERIOD (TACHO_RPM_COUNTS / 0xFFFF + 1)
+#define SPEED_CONTROL_HZ 50
+#define SPEED_CONTROL_REFRESHES (DISPLAY_REFRESH_HZ / SPEED_CONTROL_HZ)
+#if DISPLAY_REFRESH_HZ % SPEED_CONTROL_HZ != 0 || SPEED_CONTROL_REFRESHES > 255
+#error "SPEED_CONTROL_HZ must divide DISPLAY_REFRESH_HZ"
+#endif
+// control iterations without a tacho pulse before the drum is taken as stopped
+#define TACHO_TIMEOUT (SPEED_CONTROL_HZ / 2)
+#define SPEED_KP 24L
+#define SPEED_KI 4L
+#define SPEED_KD 0L
+#define SPEED_INTEGRAL_LIMIT ((int32_t)MOTOR_TOP << 8)
+#define SPEED_SLEW 8
+// Timer 1 input capture: noise canceler on, rising edge, interrupt enabled
+#define TACHO_CAPTURE ((1 << ICNC1) | (1 << ICES1))
+#define TACHO_IE (1 << ICIE1)
+#else
+#define TACHO_CAPTURE 0
+#define TACHO_IE 0
+#endif
+
+/* Time without a running program (or a button press) after which the
+ * display is blanked and the MCU is put into power-down. It is counted
+ * in display refreshes, so it must fit in 16 bits at DISPLAY_REFRESH_HZ.
+ */
+#define IDLE_TIMEOUT_MS 30000UL
+#define IDLE_REFRESHES (IDLE_TIMEOUT_MS * DISPLAY_REFRESH_HZ / 1000)
+#if IDLE_REFRESHES < 1 || IDLE_REFRESHES > 65535
+#error "IDLE_TIMEOUT_MS out of range for DISPLAY_REFRESH_HZ"
+#endif
+
+/* Checkpointing. Where a running program has got to is saved to EEPROM
+ * when it starts, at every phase boundary, every CHECKPOINT_TICKS ticks
+ * and when it is paused or resumed, so after a power cut it carries on
+ * from there (rerunning at most CHECKPOINT_TICKS ticks) instead of
+ * starting again. The records go round a ring of CHECKPOINT_SLOTS
+ * slots, so each EEPROM cell is only written once every
+ * CHECKPOINT_SLOTS records: its 100,000 writes last over 5,000 hours of
+ * running at a record every 3 s. The newest record is the valid one
+ * with the latest sequence number; one torn by a power cut part way
+ * through being written fails its CRC. Records are written a byte at a
+ * time by the EEPROM ready ISR, so nothing waits the 3.4 ms each byte
+ * takes. EEPROM from CHECKPOINT_BASE + CHECKPOINT_SLOTS *
+ * CHECKPOINT_SIZE on is left free (for USER_PROGRAMS).
+ */
+#define CHECKPOINT_TICKS 16
+#define CHECKPOINT_SLOTS 64
+#define CHECKPOINT_BASE 0 // EEPROM address of the first slot
+#define CHECKPOINT_SIZE 8 // sizeof(struct checkpoint)
+#if (CHECKPOINT_TICKS & (CHECKPOINT_TICKS - 1)) != 0 || CHECKPOINT_TICKS > 256
+#error "CHECKPOINT_TICKS must be a power of two no larger than 256"
+#endif
+#if (CHECKPOINT_SLOTS & (CHECKPOINT_SLOTS - 1)) != 0 || CHECKPOINT_BASE + CHECKPOINT_SLOTS * CHECKPOINT_SIZE > 1024
+#error "CHECKPOINT_SLOTS must be a power of two and fit in the EEPROM"
+#endif
+// program number recorded while no program is running
+#define CHECKPOINT_NO_PROGRAM 0xFF
+// added to the program number while a user program runs in place of the built-in one
+#define CHECKPOINT_USER 2
+
+/* Watchdog. The main loop only feeds it once every subsystem has shown
+ * progress since it was last fed: the display refresh always, the
+ * program tick while a program is running and with LEVEL_ADC the water
+ * level filter. A stuck ISR, a main loop that has stopped or a timer
+ * that no longer interrupts then resets the MCU within
+ * WATCHDOG_TIMEOUT, which must be well over a program tick.
+ */
+#define WATCHDOG_TIMEOUT WDTO_500MS
+#if (2048UL << WATCHDOG_TIMEOUT) * 1000 / 128000 < 2 * TICK_PERIOD_MS / TICKS_PER_PERIOD
+#error "WATCHDOG_TIMEOUT must be at least two program ticks"
+#endif
+#define PROGRESS_DISPLAY 1 // Timer 2 refreshed the display
+#define PROGRESS_TICK 2    // a program tick was counted
+#define PROGRESS_LEVEL 4   // the water level filter completed a sample
+#ifdef LEVEL_ADC
+#define PROGRESS_ALWAYS (PROGRESS_DISPLAY | PROGRESS_LEVEL)
+#else
+#define PROGRESS_ALWAYS PROGRESS_DISPLAY
+#endif
+
+/* Number of consecutive identical samples (one per display refresh)
+ * before a change on the mode or water level switches is accepted.
+ */
+#define INPUT_STABLE_SAMPLES 8
+#ifdef LEVEL_ADC
+// PIND bits read by the input latch: mode select (the level comes from the ADC)
+#define INPUT_SWITCH_MASK (1 << PIND4)
+#else
+// PIND bits read by the input latch: mode select and water level
+#define INPUT_SWITCH_MASK ((1 << PIND4) | 3)
+#endif
+
+/* Analog water level sensing, built in when LEVEL_ADC is defined in
+ * place of the two level switches on PIND1:0. The sensor is read on ADC
+ * channel LEVEL_ADC_CHANNEL; every ADC input is on PORTA, so that pin
+ * is taken away from the display (the board must not drive it). The
+ * ADC converts continuously in free running mode and its ISR does all
+ * the filtering: LEVEL_OVERSAMPLE conversions are summed and decimated
+ * to a 12-bit sample, and a moving average of the last LEVEL_AVERAGE
+ * samples gives levelFine. That is quantized into the same levels as
+ * the switches, with LEVEL_HYSTERESIS either side of each threshold;
+ * readings outside LEVEL_OPEN - LEVEL_SHORT mean a sensor error.
+ */
+#ifdef LEVEL_ADC
+#define LEVEL_ADC_CHANNEL 5
+#define LEVEL_ADC_PRESCALER 128 // 62.5 kHz ADC clock at 8 MHz, 4.8 k conversions/s
+#define LEVEL_EXTRA_BITS 2 // 12-bit samples from the 10-bit ADC
+#define LEVEL_OVERSAMPLE (1 << (2 * LEVEL_EXTRA_BITS)) // 4 conversions per extra bit
+#if LEVEL_EXTRA_BITS != 2
+#error "the level limits below are in 12-bit samples: LEVEL_EXTRA_BITS must be 2"
+#endif
+#define LEVEL_AVERAGE 8
+#if (LEVEL_AVERAGE & (LEVEL_AVERAGE - 1)) != 0
+#error "LEVEL_AVERAGE must be a power of two"
+#endif
+// levelFine limits, in 4096ths of AVCC
+#define LEVEL_OPEN 205    // 0.25 V: sensor disconnected
+#define LEVEL_EMPTY 410   // 0.5 V
+#define LEVEL_FULL 3686   // 4.5 V
+#define LEVEL_SHORT 3890  // 4.75 V: sensor shorted
+#define LEVEL_HYSTERESIS 40
+// ADC clock select bits for LEVEL_ADC_PRESCALER
+#if LEVEL_ADC_PRESCALER == 64
+#define LEVEL_ADPS ((1 << ADPS2) | (1 << ADPS1) | (0 << ADPS0))
+#elif LEVEL_ADC_PRESCALER == 128
+#define LEVEL_ADPS ((1 << ADPS2) | (1 << ADPS1) | (1 << ADPS0))
+#else
+#error "LEVEL_ADC_PRESCALER must keep the ADC clock within 50 - 200 kHz"
+#endif
+#if LEVEL_ADC_CHANNEL > 7 || LEVEL_ADC_CHANNEL == 7
+#error "LEVEL_ADC_CHANNEL must be PA0 - PA6 (PA7 selects the digit)"
+#endif
+// PORTA bits the display may drive
+#define DISPLAY_PORT_MASK ((uint8_t)~(1 << LEVEL_ADC_CHANNEL))
+#else
+#define DISPLAY_PORT_MASK 0xFF
+#endif
+
+/* Telemetry, built in when TELEMETRY is defined: a status frame (see
+ * telemetry.h) goes out on USART0 after every program tick and change
+ * of state. The main loop builds each frame and queues it in a ring of
+ * TELEMETRY_QUEUE_SIZE bytes; the USART data register empty ISR sends
+ * it a byte at a time. TXD0 is PD1, a water level switch input, so
+ * TELEMETRY needs LEVEL_ADC. The USART runs in double speed mode, where
+ * 38400 baud is within 0.2% at 8 MHz.
+ */
+#ifdef TELEMETRY
+#ifndef LEVEL_ADC
+#error "TELEMETRY needs LEVEL_ADC: TXD0 is the PD1 water level switch input"
+#endif
+#ifdef SHELL
+#define TELEMETRY_QUEUE_SIZE 128 // a status frame still fits while a reply goes out
+#else
+#define TELEMETRY_QUEUE_SIZE 64
+#endif
+#if (TELEMETRY_QUEUE_SIZE & (TELEMETRY_QUEUE_SIZE - 1)) != 0 || TELEMETRY_QUEUE_SIZE > 256
+#error "TELEMETRY_QUEUE_SIZE must be a power of two no larger than 256"
+#endif
+#if TELEMETRY_QUEUE_SIZE <= TELEMETRY_STATUS_LENGTH + 3
+#error "TELEMETRY_QUEUE_SIZE must hold a status frame"
+#endif
+#define TELEMETRY_UBRR ((F_CPU + 4 * TELEMETRY_BAUD) / (8 * TELEMETRY_BAUD) - 1)
+#define TELEMETRY_ACTUAL_BAUD (F_CPU / (8 * (TELEMETRY_UBRR + 1)))
+#if TELEMETRY_ACTUAL_BAUD * 50 > TELEMETRY_BAUD * 51 || TELEMETRY_ACTUAL_BAUD * 50 < TELEMETRY_BAUD * 49
+#error "TELEMETRY_BAUD is more than 2% out at this F_CPU"
+#endif
+#ifdef SHELL
+// USART0 control: transmitter and receiver on, data register empty interrupt off
+#define TELEMETRY_UCSRB ((1 << TXEN0) | (1 << RXEN0) | (1 << RXCIE0))
+#else
+// USART0 control: transmitter on, data register empty interrupt off
+#define TELEMETRY_UCSRB (1 << TXEN0)
+#endif
+#endif
+
+/* Command shell, built in when SHELL is defined (with TELEMETRY, whose
+ * frames carry its replies). Lines of text received on USART0 (RXD0 is
+ * PD0, the other level switch input) are commands: a name from the
+ * command table and its decimal arguments, separated by spaces. The
+ * receive ISR only collects the line; the main loop runs the command
+ * once every queued event has been handled and there is room for the
+ * reply, so no ISR ever waits for the shell. Characters received while
+ * a line waits to be run are dropped. The USART is stopped in
+ * power-down, so the shell only answers while the MCU is awake.
+ *     state            state, program, phase and program clock
+ *     start, reset     press the start or reset button
+ *     phase n          jump the running program to the start of phase n
+ *     duty n percent   set pwm[n] (until the next reset)
+ *     counters         events, frames and characters lost, failed
+ *                      commands, checkpoint sequence and reset flags
+ *     help             list the commands
+ * and with USER_PROGRAMS, to upload a user program:
+ *     edit n           start a new program for mode n (0 = normal, 1 = extended)
+ *     code b...        add up to SHELL_ARGUMENTS bytes of bytecode to it
+ *     save             check it and store it in place of the built-in program
+ *     erase n          go back to the built-in program for mode n
+ */
+#ifdef SHELL
+#ifndef TELEMETRY
+#error "SHELL needs TELEMETRY: its replies are sent as telemetry frames"
+#endif
+#ifdef USER_PROGRAMS
+#define SHELL_LINE_SIZE 40 // "code" and 8 bytes of bytecode
+#define SHELL_ARGUMENTS 8 // most arguments a command takes
+#else
+#define SHELL_LINE_SIZE 24
+#define SHELL_ARGUMENTS 2
+#endif
+#define SHELL_NAME_SIZE 9 // longest command name, and its terminating 0
+#define SHELL_STATE 0
+#define SHELL_START 1
+#define SHELL_RESET 2
+#define SHELL_PHASE 3
+#define SHELL_DUTY 4
+#define SHELL_COUNTERS 5
+#define SHELL_HELP 6
+#ifdef USER_PROGRAMS
+#define SHELL_EDIT 7
+#define SHELL_CODE 8
+#define SHELL_SAVE 9
+#define SHELL_ERASE 10
+#define SHELL_COMMANDS 11
+#else
+#define SHELL_COMMANDS 7
+#endif
+// room in the telemetry queue for a reply and the status frame after it
+#define SHELL_ROOM (TELEMETRY_FRAME_MAX + TELEMETRY_STATUS_LENGTH + 3)
+#if SHELL_ROOM >= TELEMETRY_QUEUE_SIZE
+#error "TELEMETRY_QUEUE_SIZE must hold a reply and a status frame"
+#endif
+#endif
+
+/* User programs, built in when USER_PROGRAMS is defined (with SHELL,
+ * which uploads them). Either mode's built-in program can be replaced
+ * by a program in the bytecode of bytecode.h, checked when the shell
+ * saves it and again when it is read back at boot. The programs are
+ * kept in EEPROM from USER_PROGRAM_BASE, after the checkpoints, and in
+ * SRAM while running. The main loop runs a user program a phase at a
+ * time: at each phase boundary the interpreter runs on to the next
+ * wait, at most USER_PROGRAM_SIZE instructions, and the ticks in
+ * between cost the same as with a built-in program. No ISR runs any of
+ * it.
+ */
+#ifdef USER_PROGRAMS
+#ifndef SHELL
+#error "USER_PROGRAMS needs SHELL to upload the programs"
+#endif
+#if USER_PROGRAM_SIZE % 8 != 0 || USER_PROGRAM_SIZE > 248
+#error "USER_PROGRAM_SIZE must be a multiple of 8 no larger than 248"
+#endif
+#define USER_PROGRAM_BASE 512 // EEPROM address of the normal program; the extended one follows it
+#define USER_RECORD_SIZE (USER_PROGRAM_SIZE + 2) // sizeof(struct userProgram)
+#define USER_NOT_EDITING 0xFF // mode being edited while no program is being uploaded
+#if USER_PROGRAM_BASE < CHECKPOINT_BASE + CHECKPOINT_SLOTS * CHECKPOINT_SIZE || USER_PROGRAM_BASE + 2 * USER_RECORD_SIZE > 1024
+#error "the user programs must fit in the EEPROM after the checkpoints"
+#endif
+#endif
+
+/* Button debouncing. The start (PIND2) and reset (PIND3) buttons are
+ * sampled on every display refresh and integrated: a press or release
+ * is only reported once the button has read the same for
+ * BUTTON_DEBOUNCE_MS, which also bounds the press latency.
+ */
+#define BUTTON_DEBOUNCE_MS 20
+#define BUTTON_SAMPLES (BUTTON_DEBOUNCE_MS * DISPLAY_REFRESH_HZ / 1000)
+#if BUTTON_SAMPLES < 1 || BUTTON_SAMPLES > 255
+#error "BUTTON_DEBOUNCE_MS out of range for DISPLAY_REFRESH_HZ"
+#endif
+// the switches must latch after waking before a press can start a program
+#if BUTTON_SAMPLES <= INPUT_STABLE_SAMPLES
+#error "BUTTON_DEBOUNCE_MS must be longer than INPUT_STABLE_SAMPLES refreshes"
+#endif
+// button event bits returned by debounceButtons()
+#define START_PRESSED 1
+#define START_RELEASED 2
+#define RESET_PRESSED 4
+#define RESET_RELEASED 8
+
+// a phase's LED pattern gives its running state and the event that enters it
+#if STATE_RINSE - STATE_WASH != RINSE_PATTERN - WASH_PATTERN || STATE_SPIN - STATE_WASH != SPIN_PATTERN - WASH_PATTERN
+#error "running states must be in the same order as the LED patterns"
+#endif
+#if EVENT_RINSE - EVENT_WASH != RINSE_PATTERN - WASH_PATTERN || EVENT_SPIN - EVENT_WASH != SPIN_PATTERN - WASH_PATTERN
+#error "phase events must be in the same order as the LED patterns"
+#endif
+
 // checking if extended wash mode is selected and no error is present
-#define EXTENDED (((PIND & (1 << PIND4)) == (1 << PIND4)) &&  (PIND & 3) != 3)
+#define EXTENDED (inputs.mode == 1 && inputs.error == 0)
 // checking if normal wash mode is selected and no error is present
-#define NORMAL (((PIND & (1 << PIND4)) == 0 && (PIND & 3) != 3))
+#define NORMAL (inputs.mode == 0 && inputs.error == 0)
 
 // Seven segment display values for water level/ mode select.
 uint8_t seven_seg[5] = {8, 1, 64, 121, 84};
-// Pulse Width Modulation values for OCR0B at 10%, 50% and 90%  duty cycle respectively.
-uint8_t pwm[3] = {230, 128, 26};
+// Pulse Width Modulation values for the motor at 10%, 50% and 90%  duty cycle respectively.
+motor_t pwm[3] = {MOTOR_DUTY(10), MOTOR_DUTY(50), MOTOR_DUTY(90)};
 	
-/* 0 = right display, 1 = left display */
+/* digit shown by the next display refresh: 0 = right display, 1 = left display */
 volatile uint8_t digit;
-/* index for seven_seg array */
-volatile uint8_t indexNumber;
-/* counts time for LED patterns during wash/rinse/spin cycle */
+/* PORTA value (segments and digit select) for each digit, written by
+ * the main loop and shown by the Timer 2 ISR
+ */
+volatile uint8_t frame[2];
+/* Program clock: ticks since the program started, used for the LED
+ * patterns and phase timing. It is kept as two bytes so the tick ISR's
+ * hot path is a single 8-bit increment (timeCounterHigh only changes
+ * every 256 ticks). Read the whole clock with programClock().
+ */
 volatile uint8_t timeCounter;
-/* int that stores whether system has finished or not */
-volatile uint8_t finished;
+volatile uint8_t timeCounterHigh;
+/* current state of the machine (STATE_IDLE etc.), only changed by dispatch() */
+volatile uint8_t state;
+/* fractional part of the tick period, in 1 / TICKS_PER_PERIOD counts */
+uint8_t tickFraction;
+/* display refreshes left before power-down, counted while no program is running */
+volatile uint16_t idleCountdown;
+/* PROGRESS_* bits set by the ISRs since the watchdog was last fed */
+volatile uint8_t progress;
+
+/* Debounced switch inputs. PIND is sampled once per display refresh and
+ * a new value is only latched here once it has been stable for
+ * INPUT_STABLE_SAMPLES samples, so everything that reads this struct
+ * sees one consistent set of inputs. Each change posts an EVENT_INPUT.
+ */
+struct inputState {
+	uint8_t mode;  // 1 = extended, 0 = normal (PIND4)
+	uint8_t level; // water level 0 - 2, 3 = sensor error (PIND1:0)
+	uint8_t error; // 1 if the water level shows an error
+};
+volatile struct inputState inputs;
+/* last PIND sample and how many samples in a row have matched it */
+uint8_t inputSample;
+uint8_t inputStableCount;
+
+#ifdef LEVEL_ADC
+/* Water level filter, run by the ADC ISR: the sum of the conversions
+ * so far and how many are left to the next sample, the last
+ * LEVEL_AVERAGE samples and their sum, the moving average (12 bits)
+ * and its quantized level, as the switches would give it.
+ */
+uint16_t levelSum;
+uint8_t levelCount;
+uint16_t levelSamples[LEVEL_AVERAGE];
+uint8_t levelNext;
+uint16_t levelTotal;
+uint8_t levelFresh; // 1 until a fresh filter has its first sample
+volatile uint16_t levelFine;
+volatile uint8_t levelQuantized;
+/* Thresholds between water levels 0 - 1 and 1 - 2, a third and two
+ * thirds of the way from empty to full.
+ */
+const uint16_t levelThresholds[2] PROGMEM = {
+	LEVEL_EMPTY + (LEVEL_FULL - LEVEL_EMPTY) / 3,
+	LEVEL_EMPTY + (LEVEL_FULL - LEVEL_EMPTY) * 2 / 3,
+};
+#endif
+
+/* Event queue from the ISRs to the main loop. The ISRs never nest, so
+ * together they are the single producer and only ever write
+ * eventHead; the main loop is the single consumer and only writes
+ * eventTail. Both indexes are single bytes, so neither side needs to
+ * disable interrupts.
+ */
+volatile uint8_t eventQueue[EVENT_QUEUE_SIZE];
+volatile uint8_t eventHead;
+volatile uint8_t eventTail;
+/* events dropped because the queue was full */
+volatile uint8_t eventsLost;
+
+/* postEvent function. Argument is the event to post. Adds it to the
+ * event queue; only called from ISRs (or before interrupts are enabled).
+ */
+void postEvent(uint8_t event) {
+	uint8_t head = eventHead;
+	uint8_t next = (head + 1) & (EVENT_QUEUE_SIZE - 1);
+	if (next == eventTail) {
+		eventsLost++;
+		return;
+	}
+	eventQueue[head] = event;
+	eventHead = next;
+}
+
+/* takeEvent function. Returns the oldest queued event, or EVENT_NONE
+ * if the queue is empty. Only called from the main loop.
+ */
+uint8_t takeEvent(void) {
+	uint8_t tail = eventTail;
+	uint8_t event;
+	if (tail == eventHead) {
+		return EVENT_NONE;
+	}
+	event = eventQueue[tail];
+	eventTail = (tail + 1) & (EVENT_QUEUE_SIZE - 1);
+	return event;
+}
+
+/* latchInputs function. Argument is a PIND sample. Validates it and
+ * stores it as the current inputs, posting an EVENT_INPUT if any input
+ * differs from before.
+ */
+void latchInputs(uint8_t sample) {
+	uint8_t mode = (sample >> PIND4) & 1;
+	uint8_t level = sample & 3;
+	if (mode != inputs.mode || level != inputs.level) {
+		postEvent(EVENT_INPUT);
+	}
+	inputs.mode = mode;
+	inputs.level = level;
+	inputs.error = (level == 3);
+}
+
+/* inputBits function. Argument is the value read from PIND. Returns
+ * the inputs in PIND's layout: the mode switch, and the water level from
+ * PIND1:0 or with LEVEL_ADC from the filtered ADC reading.
+ */
+uint8_t inputBits(uint8_t pind) {
+#ifdef LEVEL_ADC
+	return (pind & INPUT_SWITCH_MASK) | levelQuantized;
+#else
+	return pind & INPUT_SWITCH_MASK;
+#endif
+}
+
+/* sampleInputs function. Argument is the value read from PIND. Called
+ * on every display refresh; latches the switch inputs once they have
+ * been stable for INPUT_STABLE_SAMPLES samples.
+ */
+void sampleInputs(uint8_t pind) {
+	uint8_t sample = inputBits(pind);
+	if (sample != inputSample) {
+		inputSample = sample;
+		inputStableCount = 0;
+	} else if (inputStableCount < INPUT_STABLE_SAMPLES) {
+		inputStableCount++;
+		if (inputStableCount == INPUT_STABLE_SAMPLES) {
+			latchInputs(sample);
+		}
+	}
+}
+
+/* Debounce integrators for the start and reset buttons (0 - BUTTON_SAMPLES)
+ * and whether each is currently considered pressed.
+ */
+uint8_t startIntegrator;
+uint8_t resetIntegrator;
+uint8_t buttonsDown;
+
+/* debounceButton function. Arguments are the button's integrator, its
+ * raw level, and its pressed/released event bits. Moves the integrator
+ * one step towards the raw level and returns an event when it reaches
+ * either end and the debounced state changes.
+ */
+uint8_t debounceButton(uint8_t *integrator, uint8_t level, uint8_t pressed, uint8_t released) {
+	if (level) {
+		if (*integrator < BUTTON_SAMPLES) {
+			(*integrator)++;
+			if (*integrator == BUTTON_SAMPLES && (buttonsDown & pressed) == 0) {
+				buttonsDown |= pressed;
+				return pressed;
+			}
+		}
+	} else if (*integrator > 0) {
+		(*integrator)--;
+		if (*integrator == 0 && (buttonsDown & pressed) != 0) {
+			buttonsDown &= ~pressed;
+			return released;
+		}
+	}
+	return 0;
+}
+
+/* debounceButtons function. Argument is the value read from PIND.
+ * Returns the button events (START_PRESSED etc.) for this sample.
+ */
+uint8_t debounceButtons(uint8_t pind) {
+	return debounceButton(&startIntegrator, pind & (1 << PIND2), START_PRESSED, START_RELEASED)
+		| debounceButton(&resetIntegrator, pind & (1 << PIND3), RESET_PRESSED, RESET_RELEASED);
+}
+
+/* Power states and the peripherals left clocked in each. Every other
+ * peripheral has its bit set in PRR0, which stops its clock.
+ */
+#define POWER_IDLE 0     // no program selected, only the display runs
+#define POWER_RUNNING 1  // wash program running: display, tick timer and motor PWM
+#define POWER_FINISHED 2 // program complete, display shows 00
+#ifdef MOTOR_PWM_TIMER1
+#define POWER_MOTOR_TIMERS ((1 << PRTIM1)) // Timer 0 is not used
+#else
+#define POWER_MOTOR_TIMERS ((1 << PRTIM1) | (1 << PRTIM0))
+#endif
+#ifdef LEVEL_ADC
+#define POWER_LEVEL (1 << PRADC)
+#else
+#define POWER_LEVEL 0
+#endif
+#ifdef TELEMETRY
+#define POWER_TELEMETRY (1 << PRUSART0)
+#else
+#define POWER_TELEMETRY 0
+#endif
+// display, water level and telemetry
+#define POWER_ALWAYS ((1 << PRTIM2) | POWER_LEVEL | POWER_TELEMETRY)
+const uint8_t powerReduction[3] = {
+	(uint8_t)~POWER_ALWAYS,
+	(uint8_t)~(POWER_ALWAYS | POWER_MOTOR_TIMERS),
+	(uint8_t)~POWER_ALWAYS,
+};
+/* current power state */
+volatile uint8_t powerState;
+
+/* motorOutput function. Argument is 1 to connect the motor PWM output
+ * pin to its timer, 0 to disconnect it (the pin then stays low, so the
+ * motor is off).
+ */
+void motorOutput(uint8_t on) {
+#ifdef MOTOR_PWM_TIMER1
+	if (on) {
+		TCCR1A = (1 << COM1A1) | (1 << COM1A0) | (1 << WGM11) | (0 << WGM10);
+	} else {
+		TCCR1A = (0 << COM1A1) | (0 << COM1A0) | (1 << WGM11) | (0 << WGM10);
+	}
+#else
+	if (on) {
+		TCCR0A = (1<<COM0B1) | (1<<COM0B0) | (1<<WGM01) | (1<<WGM00);
+	} else {
+		TCCR0A = (0<<COM0B1) | (0<<COM0B0) | (1<<WGM01) | (1<<WGM00);
+	}
+#endif
+}
+
+/* motorClock function. Argument is 1 to run the motor PWM timer with no
+ * prescaling, 0 to stop it where it is.
+ */
+void motorClock(uint8_t on) {
+#ifdef MOTOR_PWM_TIMER1
+	TCCR1B = (1 << WGM13) | (0 << WGM12) | (0 << CS12) | (0 << CS11) | (on << CS10);
+#else
+	TCCR0B = (0<<WGM02) | (0<<CS02) | (0<<CS01) | (on<<CS00);
+#endif
+}
+
+/* setPowerState function. Argument is the new power state. Gates the
+ * clocks of the peripherals not needed in that state. A peripheral's
+ * registers cannot be written while its clock is stopped, so the
+ * motor PWM output is disconnected before its timer is stopped (leaving
+ * the pin low) and only reconnected once it is running again.
+ */
+void setPowerState(uint8_t power) {
+	powerState = power;
+	if (power == POWER_RUNNING) {
+		PRR0 = powerReduction[power];
+		motorOutput(1);
+	} else {
+		motorOutput(0);
+		PRR0 = powerReduction[power];
+	}
+}
 
 /* Display function. Arguments are the index of seven_seg display array
  * and the digit to display it on (0 = right, 1 = left). The function 
- * outputs the correct seven segment display value and digit select to PORTA. 
+ * stores the correct seven segment display value and digit select in the
+ * frame buffer, ready for the Timer 2 ISR to output to PORTA.
  * If a wash cycle is finished, zero is displayed on both displays.
  */
 void display(uint8_t indexNumber, uint8_t digit, uint8_t finished) {
 	if (finished == 0) {
-		PORTA = (seven_seg[indexNumber] & 0x7F) | (digit << 7);	
+		frame[digit] = ((seven_seg[indexNumber] & 0x7F) | (digit << 7)) & DISPLAY_PORT_MASK;
 	} else {
-		PORTA = 63 | (digit << 7);
+		frame[digit] = (63 | (digit << 7)) & DISPLAY_PORT_MASK;
 	}
 }
 
-/* washCycle function. Argument is the time Counter value. 
- * Function determines the appropriate PORTC output to turn 
- * on the correct LED in the wash cycle pattern.
-*/
-uint8_t washCycle(uint8_t timeCounter) {
-	if ((timeCounter / 2) % 16 < 8) {
-		return (1 << ((timeCounter / 2) % 4)); // pattern from L0 - L3 (changes on every second compare match)
-		} else {
-		return 0b00001111; // turn on all LED's
+/* programClock function. Returns the 16-bit program clock. The high
+ * byte is read again after the low byte and the read retried if a tick
+ * carried into it in between, so no interrupts need to be disabled.
+ */
+uint16_t programClock(void) {
+	uint8_t high;
+	uint8_t low;
+	do {
+		high = timeCounterHigh;
+		low = timeCounter;
+	} while (high != timeCounterHigh);
+	return ((uint16_t)high << 8) | low;
+}
+
+/* One phase of a wash program. The phase lasts duration ticks, shows
+ * ledPatterns[pattern] on PORTC and drives the motor with pwm[duty], or
+ * with SPEED_CONTROL holds the drum at speed rpm (starting from
+ * pwm[duty]). A phase with a duration of 0 marks the end of the program.
+ */
+struct phase {
+	uint16_t duration;
+	uint8_t pattern;
+	uint8_t duty;
+	uint16_t speed;
+};
+
+/* Extended program: wash for 6 s (32 ticks) at 10%, rinse for 12 s
+ * (64 ticks) at 50% and spin for 6 s (32 ticks) at 90%.
+ */
+const struct phase extendedProgram[] PROGMEM = {
+	{TICKS_FROM_SECONDS(6), WASH_PATTERN, 0, 150},
+	{TICKS_FROM_SECONDS(12), RINSE_PATTERN, 1, 600},
+	{TICKS_FROM_SECONDS(6), SPIN_PATTERN, 2, 1200},
+	{0, 0, 0, 0}
+};
+
+/* Normal program: wash, rinse and spin for 6 s (32 ticks) each. */
+const struct phase normalProgram[] PROGMEM = {
+	{TICKS_FROM_SECONDS(6), WASH_PATTERN, 0, 150},
+	{TICKS_FROM_SECONDS(6), RINSE_PATTERN, 1, 600},
+	{TICKS_FROM_SECONDS(6), SPIN_PATTERN, 2, 1200},
+	{0, 0, 0, 0}
+};
+
+#ifdef SPEED_CONTROL
+// drum speed of each pwm[] level in a user program, as in the built-in programs
+const uint16_t levelSpeeds[3] PROGMEM = {150, 600, 1200};
+#endif
+
+/* Run context: the program latched when it was started and where the
+ * scheduler is in it, with a copy of the phase the program clock is in
+ * that the outputs are driven from. Nothing on the tick path reads the
+ * inputs.
+ */
+struct runContext {
+	const struct phase *program; // program being run (0 if none)
+	uint8_t index;               // number of the phase (mod 256 in a user program)
+	struct phase current;        // the phase, copied from flash or made by the interpreter
+	uint16_t phaseEnd;           // program clock value at which phase ends
+#ifdef USER_PROGRAMS
+	const uint8_t *code;         // user program run in place of program (0 if none)
+	uint8_t pc;                  // offset of its next instruction
+	uint8_t loopLeft;            // times left round the loop being run (0 if none)
+#endif
+};
+struct runContext run;
+
+#ifdef USER_PROGRAMS
+/* A user program, as stored in EEPROM: the crc8() of the rest of it,
+ * its length in bytes (0 if there is none) and its code.
+ */
+struct userProgram {
+	uint8_t crc;
+	uint8_t length;
+	uint8_t code[USER_PROGRAM_SIZE];
+};
+_Static_assert(sizeof(struct userProgram) == USER_RECORD_SIZE, "USER_RECORD_SIZE does not match struct userProgram");
+/* The user programs for normal and extended mode, read at boot */
+struct userProgram userPrograms[2];
+/* User program writer, run by the EEPROM ready ISR once no checkpoint
+ * is being written: the program being saved and its next byte to
+ * write (USER_RECORD_SIZE once it is done).
+ */
+uint8_t userWriteSlot;
+volatile uint8_t userWriteByte;
+// bytes in each instruction, by opcode
+const uint8_t opcodeSizes[OP_COUNT] PROGMEM = {
+	[OP_END] = 1,
+	[OP_PATTERN] = 2,
+	[OP_DUTY] = 2,
+	[OP_WAIT] = 3,
+	[OP_LOOP] = 3,
+};
+
+/* userPhase function. Runs the user program from run.pc to its next
+ * wait, which makes the next phase in run.current, or to its end,
+ * which makes the phase with a duration of 0 that ends the program.
+ * The checks made on the program bound this to USER_PROGRAM_SIZE
+ * instructions; running out of them, or an instruction running past
+ * the end of the code, ends the program as well.
+ */
+void userPhase(void) {
+	const uint8_t *code = run.code;
+	uint8_t pc = run.pc;
+	uint8_t steps;
+	uint8_t opcode;
+
+	for (steps = 0; steps < USER_PROGRAM_SIZE && pc < USER_PROGRAM_SIZE; steps++) {
+		opcode = code[pc];
+		// only read the operands once they are known to be in the code
+		if (opcode == OP_END || opcode >= OP_COUNT
+			|| pc + pgm_read_byte(&opcodeSizes[opcode]) > USER_PROGRAM_SIZE) {
+			break;
+		}
+		switch (opcode) {
+		case OP_PATTERN:
+			run.current.pattern = code[pc + 1];
+			pc += 2;
+			break;
+		case OP_DUTY:
+			run.current.duty = code[pc + 1];
+#ifdef SPEED_CONTROL
+			run.current.speed = pgm_read_word(&levelSpeeds[code[pc + 1]]);
+#endif
+			pc += 2;
+			break;
+		case OP_WAIT:
+			run.current.duration = code[pc + 1] | (uint16_t)code[pc + 2] << 8;
+			run.pc = pc + 3;
+			return;
+		default: // OP_LOOP
+			if (run.loopLeft == 0) {
+				run.loopLeft = code[pc + 2]; // entering the loop
+			}
+			if (--run.loopLeft != 0) {
+				pc = code[pc + 1];
+			} else {
+				pc += 3;
+			}
+			break;
+		}
 	}
+	run.current.duration = 0;
 }
+#endif
 
-/* rinseCycle function. Argument is the time Counter value. 
- * Function determines the appropriate PORTC output to turn 
- * on the correct LED in the rinse cycle pattern.
-*/
-uint8_t rinseCycle(uint8_t timeCounter) {
-	if ((timeCounter/2) % 16 < 8) {
-		return (1 << (3-((timeCounter/2) % 4))); // pattern from L3 - L0 (changes on every second compare match)
-		} else if (timeCounter % 4 < 2) {
-		return 0b00001111;  // all LED's on for two compare matches
-		} else {
-		return 0b00000000; // all LED's off for two compare matches
+/* selectProgram function. Returns the program chosen by the mode
+ * switch, or 0 if the water level is showing an error.
+ */
+const struct phase *selectProgram(void) {
+	if (EXTENDED) {
+		return extendedProgram;
+	} else if (NORMAL) {
+		return normalProgram;
 	}
+	return 0;
 }
 
-/* spinCycle function. Argument is the time Counter value. 
- * Function determines the appropriate PORTC output to turn 
- * on the correct LED in the spin cycle pattern.
-*/
-uint8_t spinCycle(uint8_t timeCounter) {
-	if ((timeCounter/2) % 16 < 4) {
-		return (1 << ((timeCounter/2) % 4));  // pattern from L0 - L3 (changes on every second compare match)
-		} else if ((timeCounter/2) % 16 < 8) {
-		return (1 << (3 - ((timeCounter/2) % 4))); // pattern from L3 - L0 (changes on every second compare match)
-		} else if (timeCounter % 2 == 0) {
-		return 0b00001111;  // all LED's on for one compare matches
+/* nextPhase function. Moves the scheduler on to the following phase
+ * of the running program.
+ */
+void nextPhase(void) {
+	run.index++;
+#ifdef USER_PROGRAMS
+	if (run.code != 0) {
+		userPhase();
+		run.phaseEnd += run.current.duration;
+		return;
+	}
+#endif
+	memcpy_P(&run.current, &run.program[run.index], sizeof(run.current));
+	run.phaseEnd += run.current.duration;
+}
+
+/* latchProgram function. Argument is the program to run. Latches it
+ * into the run context, starting at its first phase; with
+ * USER_PROGRAMS the user program saved for its mode is run instead, if
+ * there is one.
+ */
+void latchProgram(const struct phase *program) {
+#ifdef USER_PROGRAMS
+	const struct userProgram *user = &userPrograms[program == extendedProgram];
+#endif
+	run.program = program;
+	run.index = 0;
+#ifdef USER_PROGRAMS
+	run.code = 0;
+	if (user->length != 0) {
+		run.code = user->code;
+		run.pc = 0;
+		run.loopLeft = 0;
+		userPhase();
+		run.phaseEnd = run.current.duration;
+		return;
+	}
+#endif
+	memcpy_P(&run.current, program, sizeof(run.current));
+	run.phaseEnd = run.current.duration;
+}
+
+/* programNumber function. Returns the number of the running program,
+ * as recorded in a checkpoint.
+ */
+uint8_t programNumber(void) {
+#ifdef USER_PROGRAMS
+	if (run.code != 0) {
+		return (run.program == extendedProgram) + CHECKPOINT_USER;
+	}
+#endif
+	return (run.program == extendedProgram);
+}
+
+/* One checkpoint record, as stored in an EEPROM slot. */
+struct checkpoint {
+	uint16_t sequence; // one more than the record before it (mod 2^16)
+	uint8_t program;   // 0 = normal, 1 = extended (+ CHECKPOINT_USER), or CHECKPOINT_NO_PROGRAM
+	uint8_t phase;     // index of the phase the program clock is in (mod 256)
+	uint16_t clock;    // program clock
+	uint8_t paused;    // 1 if paused with the start button
+	uint8_t crc;       // crc8() of the bytes before it
+};
+_Static_assert(sizeof(struct checkpoint) == CHECKPOINT_SIZE, "CHECKPOINT_SIZE does not match struct checkpoint");
+/* Checkpoint writer, run by the EEPROM ready ISR: the record being
+ * written, the slot it goes in and its next byte to write, and the
+ * record to write once it is done (only the newest one waits). The
+ * ISR is only enabled while there is something to write (with
+ * USER_PROGRAMS, a user program being saved as well).
+ */
+struct checkpoint checkpointWriting;
+uint8_t checkpointSlot;
+uint8_t checkpointByte;
+struct checkpoint checkpointNext;
+volatile uint8_t checkpointQueued;
+volatile uint8_t checkpointBusy; // 1 while a record is being written
+/* sequence number and program of the last record made */
+uint16_t checkpointSequence;
+uint8_t checkpointProgram;
+/* The run context as a checkpoint record, kept in SRAM through a reset:
+ * brought up to date on every tick and whenever the program starts,
+ * stops, pauses or resumes. After a watchdog reset it is newer than the
+ * last checkpoint, so the program carries on from exactly where it was.
+ */
+struct checkpoint recovery NOINIT;
+
+/* crc8 function. Arguments are the bytes to check and how many there
+ * are. Returns their CRC-8 (polynomial 0x07, starting from 0xFF, so
+ * neither an erased slot nor one of zeros passes).
+ */
+uint8_t crc8(const uint8_t *bytes, uint8_t length) {
+	uint8_t crc = 0xFF;
+	uint8_t i;
+	while (length--) {
+		crc ^= *bytes++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/* recordRun function. Argument is 1 if the program is paused with the
+ * start button. Records the run context and the program clock in
+ * recovery.
+ */
+void recordRun(uint8_t paused) {
+	recovery.sequence = 0;
+	if (run.program == 0) {
+		recovery.program = CHECKPOINT_NO_PROGRAM;
+		recovery.phase = 0;
+		recovery.clock = 0;
+		recovery.paused = 0;
+	} else {
+		recovery.program = programNumber();
+		recovery.phase = run.index;
+		recovery.clock = programClock();
+		recovery.paused = paused;
+	}
+	recovery.crc = crc8((const uint8_t *)&recovery, CHECKPOINT_SIZE - 1);
+}
+
+/* saveCheckpoint function. Makes a checkpoint of the run context last
+ * recorded by recordRun() and starts writing it to the next slot, or
+ * queues it if a record is still being written.
+ */
+void saveCheckpoint(void) {
+	struct checkpoint record = recovery;
+	record.sequence = ++checkpointSequence;
+	record.crc = crc8((const uint8_t *)&record, CHECKPOINT_SIZE - 1);
+	checkpointProgram = record.program;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if (checkpointBusy) {
+			checkpointNext = record;
+			checkpointQueued = 1;
 		} else {
-		return 0b00000000; // all LED's off for one compare matches
+			checkpointWriting = record;
+			checkpointByte = 0;
+			checkpointBusy = 1;
+			EECR |= (1 << EERIE);
+		}
+	}
+}
+
+#ifdef USER_PROGRAMS
+/* checkProgram function. Arguments are a user program and where to put
+ * its length in ticks. Checks it follows the rules in bytecode.h.
+ * Returns 0 if it does, or what is wrong with it as a string in flash.
+ */
+const char *checkProgram(const struct userProgram *program, uint16_t *length) {
+	const uint8_t *code = program->code;
+	uint8_t starts[USER_PROGRAM_SIZE / 8] = {0}; // a bit for each byte an instruction starts at
+	uint32_t ticks = 0;
+	uint32_t loopTicks;
+	uint8_t set = 0;      // bit 0: a pattern is set, bit 1: a duty is set
+	uint8_t floor = 0;    // offset a loop may go back to, after the loop before it
+	uint8_t waited = 0;   // one more than the offset of the last wait (0 if none)
+	uint8_t pc = 0;
+	uint8_t size;
+	uint8_t i;
+
+	if (program->length == 0 || program->length > USER_PROGRAM_SIZE) {
+		return PSTR("bad length");
+	}
+	while (pc < program->length) {
+		if (code[pc] >= OP_COUNT) {
+			return PSTR("bad opcode");
+		}
+		size = pgm_read_byte(&opcodeSizes[code[pc]]);
+		if (pc + size > program->length) {
+			return PSTR("instruction cut short"); // its operands would be read past the end
+		}
+		starts[pc >> 3] |= 1 << (pc & 7);
+		switch (code[pc]) {
+		case OP_END:
+			if (pc + 1 != program->length) {
+				return PSTR("code after end");
+			}
+			if (ticks == 0) {
+				return PSTR("no wait");
+			}
+			*length = ticks;
+			return 0;
+		case OP_PATTERN:
+			if (code[pc + 1] >= PATTERN_COUNT) {
+				return PSTR("bad pattern");
+			}
+			set |= 1;
+			break;
+		case OP_DUTY:
+			if (code[pc + 1] >= sizeof(pwm) / sizeof(pwm[0])) {
+				return PSTR("bad duty");
+			}
+			set |= 2;
+			break;
+		case OP_WAIT:
+			if (set != 3) {
+				return PSTR("wait before pattern and duty");
+			}
+			if (code[pc + 1] == 0 && code[pc + 2] == 0) {
+				return PSTR("bad wait");
+			}
+			ticks += code[pc + 1] | (uint16_t)code[pc + 2] << 8;
+			waited = pc + 1;
+			break;
+		case OP_LOOP:
+			if (code[pc + 1] >= pc || code[pc + 1] < floor
+				|| (starts[code[pc + 1] >> 3] & (1 << (code[pc + 1] & 7))) == 0) {
+				return PSTR("bad loop");
+			}
+			if (code[pc + 2] == 0) {
+				return PSTR("bad loop count");
+			}
+			if (waited <= code[pc + 1]) {
+				return PSTR("loop without wait");
+			}
+			// the loop runs its waits count - 1 more times
+			loopTicks = 0;
+			for (i = code[pc + 1]; i < pc; i += pgm_read_byte(&opcodeSizes[code[i]])) {
+				if (code[i] == OP_WAIT) {
+					loopTicks += code[i + 1] | (uint16_t)code[i + 2] << 8;
+				}
+			}
+			ticks += loopTicks * (code[pc + 2] - 1);
+			floor = pc + size;
+			break;
+		}
+		if (ticks > 0xFFFF) {
+			return PSTR("too long");
+		}
+		pc += size;
+	}
+	return PSTR("no end");
+}
+
+/* loadUserPrograms function. Reads the user programs from EEPROM,
+ * dropping any that fails its CRC or its checks (one erased, or torn by
+ * a power cut while it was being saved).
+ */
+void loadUserPrograms(void) {
+	uint16_t ticks;
+	uint8_t slot;
+
+	for (slot = 0; slot < 2; slot++) {
+		struct userProgram *program = &userPrograms[slot];
+		eeprom_read_block(program, (const void *)(uintptr_t)(USER_PROGRAM_BASE + slot * USER_RECORD_SIZE), USER_RECORD_SIZE);
+		if (program->length > USER_PROGRAM_SIZE
+			|| crc8(&program->length, program->length + 1) != program->crc
+			|| checkProgram(program, &ticks) != 0) {
+			program->length = 0;
+		}
+	}
+	userWriteByte = USER_RECORD_SIZE;
+}
+
+/* saveUserProgram function. Argument is a mode (0 = normal, 1 =
+ * extended). Stores its user program, as it now is in SRAM, in EEPROM:
+ * the EEPROM ready ISR writes it once any checkpoint being written is
+ * done.
+ */
+void saveUserProgram(uint8_t slot) {
+	struct userProgram *program = &userPrograms[slot];
+	program->crc = crc8(&program->length, program->length + 1);
+	userWriteSlot = slot;
+	userWriteByte = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		EECR |= (1 << EERIE);
+	}
+}
+#endif
+
+/* Shadow copy of the outputs for the tick that has just begun. The
+ * main loop fills it in and the motor timer overflow ISR commits it, so
+ * the LED pattern and the motor duty always change together, at the
+ * start of a PWM period. The overflow interrupt is only enabled while a
+ * commit is pending or the motor duty is ramping.
+ */
+struct outputState {
+	uint8_t leds; // PORTC
+	motor_t duty; // MOTOR_OCR
+};
+volatile struct outputState shadow;
+/* Motor ramp, run by the motor timer overflow ISR: the compare values
+ * it runs from and to, how far apart they are and in which direction,
+ * the curve step reached (RAMP_STEPS once the duty has arrived) and the
+ * PWM periods left before the next step.
+ */
+motor_t rampFrom;
+motor_t rampTo;
+motor_t rampSize;
+uint8_t rampRising;
+uint8_t rampStep;
+uint8_t rampCountdown;
+
+#ifdef SPEED_CONTROL
+/* Tacho, kept by the Timer 1 capture and compare ISRs: the Timer 1
+ * counts of all the ticks before the current one (mod 2^16), the
+ * timestamp of the last pulse, whether there was one since the tacho
+ * was restarted, the counts between the last two pulses and whether
+ * that has changed since the speed loop last ran.
+ */
+volatile uint16_t tachoBase;
+volatile uint16_t tachoLast;
+volatile uint8_t tachoValid;
+volatile uint16_t tachoPeriod;
+volatile uint8_t tachoFresh;
+/* Speed loop, run by actionControl(): the target and measured drum
+ * speeds in rpm, the open loop duty of the phase and the controller
+ * output (both in PWM counts the motor is on for), the integral term,
+ * the speed measured last iteration and the iterations since a pulse.
+ */
+uint16_t speedTarget;
+uint16_t speedMeasured;
+int16_t speedFeedForward;
+int16_t speedOutput;
+int32_t speedIntegral;
+uint16_t speedLastMeasured;
+uint8_t speedStale;
+// display refreshes until the speed loop next runs
+uint8_t controlCountdown;
+#endif
+
+/* outputPhase function. Computes the PWM duty cycle and the LED
+ * pattern of the current phase for the current timeCounter value and
+ * queues them for the next motor timer overflow.
+ */
+void outputPhase(void) {
+	uint8_t leds = pgm_read_byte(&ledPatterns[run.current.pattern][timeCounter % PATTERN_LENGTH]);
+#ifdef SPEED_CONTROL
+	// the speed loop drives the motor towards the phase's target speed
+	speedTarget = run.current.speed;
+	speedFeedForward = MOTOR_TOP - pwm[run.current.duty];
+	motor_t duty = MOTOR_TOP - speedOutput;
+#else
+	motor_t duty = pwm[run.current.duty];
+#endif
+	MOTOR_TIMSK = (0 << MOTOR_TOIE); // the ISR must not see half an update
+	shadow.leds = leds;
+	shadow.duty = duty;
+	MOTOR_TIFR = (1 << MOTOR_TOV); // only an overflow from now on commits it
+	MOTOR_TIMSK = (1 << MOTOR_TOIE);
+}
+
+#ifdef SPEED_CONTROL
+/* speedStart function. Restarts the speed loop with the motor off and
+ * the drum taken as stopped, when a program starts or resumes.
+ */
+void speedStart(void) {
+	speedOutput = 0;
+	speedIntegral = 0;
+	speedMeasured = 0;
+	speedLastMeasured = 0;
+	speedStale = 0;
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		tachoValid = 0;
+		tachoFresh = 0;
+		tachoPeriod = TACHO_STOPPED;
+	}
+}
+#endif
+
+/* restartIdleTimeout function. Reloads the idle timeout from the main
+ * loop; the Timer 2 ISR decrements it, so it is written atomically.
+ */
+void restartIdleTimeout(void) {
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		idleCountdown = IDLE_REFRESHES;
+	}
+}
+
+/* nextTickCompare function. Returns one less than the length of the
+ * next tick in counts (the OCR1A value for it in CTC mode): TICK_BASE
+ * counts, or one more whenever the fractional accumulator overflows.
+ */
+uint16_t nextTickCompare(void) {
+	tickFraction += TICK_REMAINDER;
+	if (tickFraction >= TICKS_PER_PERIOD) {
+		tickFraction -= TICKS_PER_PERIOD;
+		return TICK_BASE; // TICK_BASE + 1 counts
+	}
+	return TICK_BASE - 1; // TICK_BASE counts
+}
+
+#ifdef MOTOR_PWM_TIMER1
+/* Display refreshes left in the current tick, and whether they are
+ * being counted (cleared while no program runs or it is paused).
+ */
+volatile uint16_t tickCountdown;
+volatile uint8_t tickRunning;
+#endif
+
+/* tickStart function. Starts timing program ticks from now. */
+void tickStart(void) {
+	tickFraction = 0; // start the tick period from a whole count
+#ifdef MOTOR_PWM_TIMER1
+	tickCountdown = nextTickCompare() + 1; // length of the first tick
+	tickRunning = 1;
+#else
+	OCR1A = nextTickCompare(); // length of the first tick
+	TCNT1 = 0; // count the first tick from now
+	TCCR1B = TACHO_CAPTURE | (0 << WGM13) | (1 << WGM12) | TICK_CS; // turning on clock with prescaler of TICK_PRESCALER
+	TIMSK1 = TACHO_IE | (1 << OCIE1A); // turning on interrupt for clock 1
+	TIFR1 = (1 << OCF1A); // clear interrupt flag
+#endif
+}
+
+/* tickRun function. Argument is 0 to stop counting the current tick
+ * where it is, 1 to carry on counting it.
+ */
+void tickRun(uint8_t on) {
+#ifdef MOTOR_PWM_TIMER1
+	tickRunning = on;
+#else
+	if (on) {
+		TCCR1B = TACHO_CAPTURE | (0 << WGM13) | (1 << WGM12) | TICK_CS;
+	} else {
+		TCCR1B = TACHO_CAPTURE | (0 << WGM13) | (1 << WGM12) | (0 << CS12) | (0 << CS11) | (0 << CS10);
 	}
+#endif
+}
+
+/* tickStop function. Stops timing program ticks. */
+void tickStop(void) {
+#ifdef MOTOR_PWM_TIMER1
+	tickRunning = 0;
+#else
+	TIMSK1 = (0 << OCIE1A); // disable timer 1 interrupts
+	TIFR1 = (1 << OCF1A); // clear timer 1 interrupt flag
+	TCCR1B =  (0 << CS12) | (0 << CS11) | (0 <<CS10); // Turn clock off
+#endif
 }
 
 /* reset function. This function is used to reset 
@@ -88,39 +1338,233 @@ uint8_t spinCycle(uint8_t timeCounter) {
 */
 void reset() {
 	timeCounter = 0; // reset timer counter to 0
-	TIMSK1 = (0 << OCIE1A); // disable timer 1 interrupt
-	TIFR1 = (1 << OCF1A); // clear timer 1 interrupt flag
-	OCR0B = 255; // turn off PWM controlled LED
+	timeCounterHigh = 0;
+	run.program = 0; // no program running
+	recordRun(0);
+	if (checkpointProgram != CHECKPOINT_NO_PROGRAM) {
+		saveCheckpoint(); // a power cut from now on must not resume it
+	}
+	tickStop();
+	MOTOR_TIMSK = (0 << MOTOR_TOIE); // drop any output commit or ramp still pending
+	MOTOR_OCR = MOTOR_TOP; // turn off PWM controlled LED
+	rampTo = MOTOR_TOP;
+	rampStep = RAMP_STEPS;
+	motorClock(1); // restart the motor timer if the program was paused
 	PORTC = 0; // turn off LED's
-	TCCR1B =  (0 << CS12) | (0 << CS11) | (0 <<CS10); // Turn clock off
-	EIMSK = (1 << INT0) | (1 << INT1); // turn on B0 and B1 interrupts
-	EIFR = (1 << INTF0) | (1 << INTF1); // clearing interrupt flags
+	restartIdleTimeout(); // start counting down to power-down
+	setPowerState(POWER_IDLE); // stop the clocks of the tick and motor timers
 }
 
 /* startSystem function. This function is used to start the 
  * LED pattern when B0 is pressed.
  */
 void startSystem() {
+			setPowerState(POWER_RUNNING); // clock the tick and motor timers before they are set up
 			timeCounter = 0; // reset timer counter to 0
-			PORTC = 1; // turn on LED 0 on the IO Board
-			OCR0B = pwm[0]; // turn on 10% duty cycle PWM
-			TCCR1B = (0 << WGM13) | (1 << WGM12) | (1 << CS12) | (0 << CS11) | (0 <<CS10); // turning on clock with prescaler of 256
-			TIMSK1 = (1 << OCIE1A); // turning on interrupt for clock 1
-			TIFR1 = (1 << OCF1A); // clear interrupt flag
-			EIMSK = (0 << INT0) | (1 << INT1); // turn off interrupt associated with B0 while ensuring B1 interrupt is still on
-			EIFR = (1 <<INTF0) | (1 << INTF1); // clear interrupt flags
+			timeCounterHigh = 0;
+			latchProgram(selectProgram()); // start at the first phase of the selected program
+#ifdef SPEED_CONTROL
+			speedStart();
+#endif
+			outputPhase(); // turn on the first LED and PWM duty cycle of that phase
+			tickStart();
+			recordRun(0);
+			saveCheckpoint();
 }
 
-int main(void) {
+#ifdef LEVEL_ADC
+/* levelStart function. Starts the ADC converting the water level
+ * continuously, with a fresh filter.
+ */
+void levelStart(void) {
+	levelSum = 0;
+	levelCount = LEVEL_OVERSAMPLE;
+	levelFresh = 1; // the first sample fills the moving average
+	ADMUX = (0 << REFS1) | (1 << REFS0) | LEVEL_ADC_CHANNEL; // AVCC reference, right adjusted
+	ADCSRB = 0; // free running
+	ADCSRA = (1 << ADEN) | (1 << ADSC) | (1 << ADATE) | (1 << ADIF) | (1 << ADIE) | LEVEL_ADPS;
+}
+#endif
+
+#ifdef TELEMETRY
+/* Telemetry queue from the main loop to the USART data register empty
+ * ISR: the main loop is the single producer and only writes
+ * telemetryHead, the ISR the single consumer and only writes
+ * telemetryTail. One byte is always left empty to tell full from empty.
+ */
+volatile uint8_t telemetryQueue[TELEMETRY_QUEUE_SIZE];
+volatile uint8_t telemetryHead;
+volatile uint8_t telemetryTail;
+/* sequence number of the next frame */
+uint8_t telemetrySequence;
+/* frames dropped because the queue was full */
+uint8_t telemetryLost;
+#ifdef SHELL
+/* Command line being received. The receive ISR only adds to it while
+ * shellReady is clear, and the main loop only reads it while it is set.
+ */
+uint8_t shellLine[SHELL_LINE_SIZE];
+volatile uint8_t shellLength;
+volatile uint8_t shellBad;   // 1 if the line was too long or garbled
+volatile uint8_t shellReady; // 1 once the line is complete
+/* characters dropped, and command lines that failed */
+volatile uint8_t shellDropped;
+uint8_t shellErrors;
+/* Reply frame being built, and the length of its payload so far */
+uint8_t shellReply[TELEMETRY_PAYLOAD_MAX + 1];
+uint8_t shellReplyLength;
+#ifdef USER_PROGRAMS
+/* User program being uploaded, and the mode it is for */
+struct userProgram userUpload;
+uint8_t userEditing; // USER_NOT_EDITING if none
+#endif
+#endif
+
+/* cobsEncode function. Arguments are the bytes to encode, how many
+ * there are and where to put them. Encodes them with consistent
+ * overhead byte stuffing, so the output holds no zero bytes, and ends
+ * it with a zero byte. Returns the length of the output (length + 2
+ * for up to 254 bytes).
+ */
+uint8_t cobsEncode(const uint8_t *bytes, uint8_t length, uint8_t *out) {
+	uint8_t code = 0; // index of the code byte of the current block
+	uint8_t next = 1;
+	while (length--) {
+		if (*bytes != 0) {
+			out[next++] = *bytes;
+		}
+		if (*bytes++ == 0 || next - code == 0xFF) {
+			out[code] = next - code;
+			code = next++;
+		}
+	}
+	out[code] = next - code;
+	out[next++] = 0;
+	return next;
+}
+
+/* telemetryRoom function. Returns how many bytes the telemetry queue
+ * has room for.
+ */
+uint8_t telemetryRoom(void) {
+	return (telemetryTail - telemetryHead - 1) & (TELEMETRY_QUEUE_SIZE - 1);
+}
+
+/* sendFrame function. Arguments are a frame's payload, with a byte to
+ * spare after it for the CRC, and its length. Numbers the frame and
+ * queues it for the USART, or counts it lost if there is no room for
+ * all of it.
+ */
+void sendFrame(uint8_t *payload, uint8_t length) {
+	uint8_t packet[TELEMETRY_FRAME_MAX];
+	uint8_t head;
+	uint8_t i;
+
+	payload[TELEMETRY_SEQUENCE] = telemetrySequence;
+	payload[length] = crc8(payload, length);
+	length = cobsEncode(payload, length + 1, packet);
+	if (telemetryRoom() < length) {
+		telemetryLost++;
+		return;
+	}
+	head = telemetryHead;
+	for (i = 0; i < length; i++) {
+		telemetryQueue[head] = packet[i];
+		head = (head + 1) & (TELEMETRY_QUEUE_SIZE - 1);
+	}
+	telemetryHead = head;
+	telemetrySequence++;
+	UCSR0B = TELEMETRY_UCSRB | (1 << UDRIE0); // send it
+}
+
+/* sendTelemetry function. Sends a status frame of the machine as it is
+ * now.
+ */
+void sendTelemetry(void) {
+	uint8_t payload[TELEMETRY_STATUS_LENGTH + 1];
+	uint16_t duty;
+	uint16_t speed = 0;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		duty = MOTOR_OCR; // Timer 1's is 16 bits, and the ramp changes it
+	}
+#ifdef SPEED_CONTROL
+	speed = speedMeasured;
+#endif
+	payload[TELEMETRY_TYPE] = TELEMETRY_STATUS;
+	payload[TELEMETRY_STATE] = state;
+	payload[TELEMETRY_PROGRAM] = recovery.program;
+	payload[TELEMETRY_PHASE] = recovery.phase;
+	payload[TELEMETRY_CLOCK] = (uint8_t)recovery.clock;
+	payload[TELEMETRY_CLOCK + 1] = recovery.clock >> 8;
+	payload[TELEMETRY_PIND] = PIND;
+	payload[TELEMETRY_DUTY] = (uint8_t)duty;
+	payload[TELEMETRY_DUTY + 1] = duty >> 8;
+	payload[TELEMETRY_SPEED] = (uint8_t)speed;
+	payload[TELEMETRY_SPEED + 1] = speed >> 8;
+	payload[TELEMETRY_EVENTS_LOST] = eventsLost;
+	payload[TELEMETRY_FRAMES_LOST] = telemetryLost;
+	sendFrame(payload, TELEMETRY_STATUS_LENGTH);
+}
+#endif
+
+/* Reset flags (MCUSR) of the last reset, saved by saveResetFlags() */
+uint8_t resetFlags NOINIT;
+
+/* saveResetFlags function. Run by the startup code, before RAM is
+ * initialized: saves and clears the reset flags and stops the watchdog,
+ * which after a watchdog reset would otherwise keep running at its
+ * shortest timeout and reset the MCU again before setup() is reached.
+ */
+void saveResetFlags(void) INIT3;
+void saveResetFlags(void) {
+	resetFlags = MCUSR;
+	MCUSR = 0;
+	wdt_disable();
+}
+
+/* setup function. Configures the ports, timers and external
+ * interrupts. Called once from main() (or from the host driver).
+ */
+void setup(void) {
+#ifdef LEVEL_ADC
+	/* Set port A to be outputs, except the water level sensor input */
+	DDRA = DISPLAY_PORT_MASK;
+	DIDR0 = (1 << LEVEL_ADC_CHANNEL); // analog only, no digital input buffer
+#else
 	/* Set port A (all pins) to be outputs */
 	DDRA = 0xFF;
+#endif
 	/* Set first 4 pins of PORTC to outputs */
 	DDRC = 0xFF & 0b00001111;
 	/* Set port B, pin 4 to be an output */
 	DDRB = (1 << PORTB4);
+#ifdef MOTOR_PWM_TIMER1
+	/* Set all pins on PortD to be inputs, except PD5 (OC1A), the motor PWM */
+	DDRD = (1 << PORTD5);
+#else
 	/* Set all pins on PortD to be inputs */
 	DDRD = 0;
+#endif
 
+#ifdef MOTOR_PWM_TIMER1
+	/* Timer 0 is not used */
+	TCCR0A = 0;
+	TCCR0B = 0;
+
+	/* Initializing timer 1 for the motor PWM
+	 * WGM13 = 1 & WGM12 = 0 & WGM11 = 1 & WGM10 = 0  -> phase correct PWM, TOP = ICR1
+	 * COM1A1 = 1 & COM1A0 = 1 -> set on compare match counting up, clear counting down
+	 * CS12 = 0 & CS11 = 0 & CS10 = 1  -> clock with no prescaler
+	 * ICR1 = MOTOR_TOP, OCR1A = MOTOR_TOP  -> OC1A pin is off
+	 */
+	ICR1 = MOTOR_TOP;
+	OCR1A = MOTOR_TOP;
+	motorOutput(1);
+	motorClock(1);
+	TIMSK1 = (0 << TOIE1); // enabled by outputPhase() when there are outputs to commit
+	tickRunning = 0;
+#else
 	/* Initializing appropriate settings for Fast PWM
 	WGM02 = 0 & WGM01 = 1 & WGM00 = 1  -> Fast  PWM mode
 	COM0B1 = 1 & COM0B0 = 1 -> Set on compare match, clear on bottom
@@ -128,124 +1572,1381 @@ int main(void) {
 	OCR0B = 255  -> OC0B pin is off 
 	*/
 	OCR0B = 255;
-	TCCR0A = (1<<COM0B1) | (1<<COM0B0) | (1<<WGM01) | (1<<WGM00);
-	TCCR0B = (0<<WGM02) | (0<<CS02) | (0<<CS01) | (1<<CS00);
-		
+	motorOutput(1);
+	motorClock(1);
+	TIMSK0 = (0 << TOIE0); // enabled by outputPhase() when there are outputs to commit
+
 	/* Initializing timer to appropriate settings
 	 * WGM13 = 0 & WGM12 = 1  -> CTC mode
 	 * CS12 = 0 & CS11 = 0 & CS10 0  -> Clock Off
-	 * OCR1A = 5858  -> appropriate value so that when the clock 
-	 * is set to a prescaler of 256 it will cycle 
-	 * 16 times every 3 seconds.
+	 * OCR1A = TICK_BASE - 1  -> nominal tick length; startSystem() and the
+	 * Timer 1 ISR set each tick's exact length with nextTickCompare()
 	*/
-	OCR1A = 5858;  
+	OCR1A = TICK_BASE - 1;  
 	TCCR1A = 0;  
 	TCCR1B = (0 << WGM13) | (1 << WGM12) | (0 << CS12) | (0 << CS11) | (0 <<CS10); 
+#endif
+	rampTo = MOTOR_TOP;
+	rampStep = RAMP_STEPS;
 	
-	OCR2A = 255;
-	TCCR2A = (0 << COM1A1) | (1 << COM1A0)  // Toggle OC1A on compare match
-		| (0 << WGM11) | (0 << WGM10); // Least two significant WGM bits
-	TCCR2B = (0 << WGM13) | (1 << WGM12) // Two most significant WGM bits
-		| (0 << CS12) | (0 << CS11) | (1 <<CS10); // Turn clock on
-	
-	
-	/* Set up interrupts to occur on rising edge of pin D2 (start button) and D3 (reset button) */
-	EICRA = (1 << ISC01)|(0 << ISC00) | (1 << ISC11)|(0 << ISC10);
-	EIMSK = (1 << INT0) | (1 << INT1);
-	EIFR = (1 << INTF0) | (1 << INTF1);
+	/* Initializing timer 2 to refresh the display
+	 * WGM22 = 0 & WGM21 = 1 & WGM20 = 0  -> CTC mode
+	 * OCR2A = DISPLAY_OCR  -> compare match DISPLAY_REFRESH_HZ times a second
+	 * OCIE2A = 1  -> interrupt on compare match
+	 */
+	OCR2A = DISPLAY_OCR;
+	TCCR2A = (1 << WGM21) | (0 << WGM20);
+	TCCR2B = (0 << WGM22) | DISPLAY_CS;
+	TIMSK2 = (1 << OCIE2A);
 	
-	/* Turn on global interrupts */
-	sei();
+	/* Pin change interrupts on PD2 (start button, PCINT26) and PD3 (reset
+	 * button, PCINT27) wake the MCU from power-down. Unlike the INT0 and
+	 * INT1 edges they are detected without the I/O clock. They are only
+	 * enabled in power-down; while awake the buttons are debounced from
+	 * the display refresh instead.
+	 */
+	PCMSK3 = (1 << PCINT26) | (1 << PCINT27);
+	PCICR = (0 << PCIE3);
 
 	// Initializing variables to there respective starting states
-	finished = 0;
+	state = STATE_IDLE;
 	digit = 0;
-	while(1) {
-		/* sets value for seven_seg index to the appropriate water level output index 
-		 * (if right display is selected) or the appropriate mode select index
-		 * (if left display is selected).
-		*/
-		if (digit == 0) {
-			indexNumber = PIND & 0x3;
-		} else {
-			if ((PIND & 16) == 16) {
-				indexNumber = 3;
-			} else {
-				indexNumber = 4;
-			}
-		}
-		/* display the appropriate value on seven-segment display */
-		display(indexNumber, digit, finished);
-		/* Change the digit flag for next time. if 0 becomes 1, if 1 becomes 0. */
-		digit = 1 - digit;
+	timeCounter = 0;
+	timeCounterHigh = 0;
+	run.program = 0;
+	startIntegrator = 0;
+	resetIntegrator = 0;
+	buttonsDown = 0;
+	idleCountdown = IDLE_REFRESHES;
+	eventHead = 0;
+	eventTail = 0;
+	eventsLost = 0;
+#ifdef TELEMETRY
+	/* Initializing USART0 to send telemetry
+	 * U2X0 = 1  -> double speed, UBRR0 = TELEMETRY_UBRR
+	 * UCSZ01 = 1 & UCSZ00 = 1  -> 8 data bits, no parity, 1 stop bit
+	 * TXEN0 = 1  -> transmitter on; UDRIE0 is set while there is a frame to send
+	 * RXEN0 = 1 & RXCIE0 = 1  -> with SHELL, receiver on and interrupting
+	 */
+	telemetryHead = 0;
+	telemetryTail = 0;
+	telemetrySequence = 0;
+	telemetryLost = 0;
+#ifdef SHELL
+	shellLength = 0;
+	shellBad = 0;
+	shellReady = 0;
+	shellDropped = 0;
+	shellErrors = 0;
+#ifdef USER_PROGRAMS
+	userEditing = USER_NOT_EDITING;
+#endif
+#endif
+	UBRR0 = TELEMETRY_UBRR;
+	UCSR0A = (1 << U2X0);
+	UCSR0C = (1 << UCSZ01) | (1 << UCSZ00);
+	UCSR0B = TELEMETRY_UCSRB;
+#endif
+#ifdef SPEED_CONTROL
+	controlCountdown = SPEED_CONTROL_REFRESHES;
+#endif
+#ifdef LEVEL_ADC
+	levelQuantized = 3; // a sensor error until the first reading
+#endif
+	inputSample = inputBits(PIND);
+	inputStableCount = INPUT_STABLE_SAMPLES;
+	latchInputs(inputSample);
+	eventTail = eventHead; // the first inputs are not a change
+	setPowerState(POWER_IDLE);
+#ifdef LEVEL_ADC
+	levelStart(); // once the ADC is clocked
+#endif
+	progress = 0;
+	wdt_enable(WATCHDOG_TIMEOUT);
+}
+
+/* phaseEvent function. Returns the event that enters the running
+ * state of the current phase.
+ */
+uint8_t phaseEvent(void) {
+	return EVENT_WASH + run.current.pattern - WASH_PATTERN;
+}
 
-		/* Wait for timer 1 to reach output compare A value.
-		 * We can monitor the OCF1A bit in the TIFR1 register. When 
-		 * it becomes 1, we know that the output compare value has
-		 * been reached. We can write a 1 to this bit to clear it.
-		 */
-		while ((TIFR2 & (1 << OCF2A)) == 0) {
-		 	; /* Do nothing - wait for the bit to be set */
+/* actionNone function. For transitions that only change state. */
+uint8_t actionNone(void) {
+	return EVENT_NONE;
+}
+
+/* actionStart function. Handles a debounced press of the start
+ * button (B0) while no program is running: starts the selected program
+ * unless the water level shows an error.
+ */
+uint8_t actionStart(void) {
+	restartIdleTimeout(); // a button press restarts the idle timeout
+	if (selectProgram() == 0) {
+		return EVENT_NONE;
+	}
+	startSystem();
+	return phaseEvent();
+}
+
+/* actionTick function. Handles a program tick while a program is
+ * running: advances the program clock and the latched program, raising
+ * an event when it enters a new phase or has ended.
+ */
+uint8_t actionTick(void) {
+	// add 1 to counter every time clock counter restarts (carrying into the high byte)
+	timeCounter += 1;
+	if (timeCounter == 0) {
+		timeCounterHigh += 1;
+	}
+	/* The phase only has to move on when its duration is up; the low
+	 * bytes are compared first so most ticks need no 16-bit work.
+	 */
+	if (timeCounter != (uint8_t)run.phaseEnd || programClock() != run.phaseEnd) {
+		outputPhase();
+		recordRun(state == STATE_PAUSED);
+		if ((timeCounter & (CHECKPOINT_TICKS - 1)) == 0) {
+			saveCheckpoint();
 		}
-		/* Clear the output compare flag - by writing a 1 to it. */
-		TIFR2 &= (1 << OCF2A);
+		return EVENT_NONE;
+	}
+	nextPhase();
+	if (run.current.duration == 0) {
+		return EVENT_DONE;
+	}
+	outputPhase();
+	recordRun(state == STATE_PAUSED);
+	saveCheckpoint();
+	return phaseEvent();
+}
+
+/* actionInput function. Handles a change of the switch inputs while a
+ * program is running: raises EVENT_FAULT if the water level shows an
+ * error, or EVENT_MODE if the mode switch no longer selects the
+ * running program.
+ */
+uint8_t actionInput(void) {
+	if (inputs.error) {
+		return EVENT_FAULT;
+	}
+	if (selectProgram() != run.program) {
+		return EVENT_MODE;
 	}
+	return EVENT_NONE;
+}
+
+/* actionReset function. Handles a debounced press of the reset
+ * button (B1).
+ */
+uint8_t actionReset(void) {
+	reset(); // reseting system if B1 is pressed (also restarts the idle timeout)
+	return EVENT_NONE;
+}
+
+/* actionFinish function. Stops the program once its last phase has
+ * ended.
+ */
+uint8_t actionFinish(void) {
+	reset();
+	setPowerState(POWER_FINISHED);
+	return EVENT_NONE;
 }
 
-ISR(INT0_vect) {
-	/* checking if extended or normal mode conditions are
-	 * met and if so system cycle is started. 
+/* actionPause function. Handles a press of the start button while a
+ * program is running, or the water level showing an error. The tick
+ * and motor timers are stopped where they are, so the tick counts and
+ * the tick accumulator still hold the rest of the current tick and the
+ * motor PWM keeps its phase; the PWM output is disconnected so the
+ * motor is off. The LEDs keep showing the paused pattern (outputs
+ * queued while paused are committed once the motor timer runs again).
+ */
+uint8_t actionPause(void) {
+	tickRun(0);
+	motorOutput(0);
+	motorClock(0);
+	recordRun(state == STATE_PAUSED);
+	saveCheckpoint();
+	return EVENT_NONE;
+}
+
+/* actionResume function. Handles a press of the start button while
+ * paused, or the water level error clearing: restarts both timers from
+ * where they stopped, so the program runs for exactly its remaining
+ * time (the part of a tick count that was in progress when it was
+ * paused is lost: at most TICK_PRESCALER CPU cycles, or a display
+ * refresh with MOTOR_PWM_TIMER1), and goes back to the paused phase.
+ * Stays paused while the water level shows an error.
+ */
+uint8_t actionResume(void) {
+	if (inputs.error) {
+		return EVENT_FAULT;
+	}
+#ifdef SPEED_CONTROL
+	speedStart(); // the drum has slowed down while paused
+#endif
+	motorClock(1);
+	motorOutput(1);
+	tickRun(1);
+	recordRun(0);
+	saveCheckpoint();
+	return phaseEvent();
+}
+
+/* actionLateTick function. Handles a tick that was counted before
+ * the program was paused but that is only taken from the queue once
+ * paused: the program still advances, but stays paused unless it has
+ * ended (resuming picks up whichever phase it is then in).
+ */
+uint8_t actionLateTick(void) {
+	if (actionTick() == EVENT_DONE) {
+		return EVENT_DONE;
+	}
+	return EVENT_NONE;
+}
+
+#ifdef SPEED_CONTROL
+/* actionControl function. Runs one iteration of the drum speed loop
+ * while a program is running: measures the speed from the last tacho
+ * pulse period and moves the motor duty towards the phase's target
+ * speed. Every iteration takes the same path, one division included,
+ * so it always costs the same.
+ */
+uint8_t actionControl(void) {
+	uint16_t period;
+	uint8_t fresh;
+	int16_t error;
+	int16_t change;
+	int32_t integral;
+	int32_t output;
+	int32_t applied;
+
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		period = tachoPeriod;
+		fresh = tachoFresh;
+		tachoFresh = 0;
+	}
+	// no pulse for TACHO_TIMEOUT iterations: the drum has (nearly) stopped
+	speedStale = fresh ? 0 : speedStale + (speedStale != TACHO_TIMEOUT);
+	if (speedStale == TACHO_TIMEOUT) {
+		period = TACHO_STOPPED;
+	}
+	speedMeasured = TACHO_RPM_COUNTS / period;
+	error = (int16_t)(speedTarget - speedMeasured);
+
+	integral = speedIntegral + SPEED_KI * error;
+	if (integral > SPEED_INTEGRAL_LIMIT) {
+		integral = SPEED_INTEGRAL_LIMIT;
+	} else if (integral < -SPEED_INTEGRAL_LIMIT) {
+		integral = -SPEED_INTEGRAL_LIMIT;
+	}
+	// derivative on the measurement, so a new target does not kick the output
+	change = (int16_t)(speedMeasured - speedLastMeasured);
+	speedLastMeasured = speedMeasured;
+	output = speedFeedForward + ((SPEED_KP * error + integral - SPEED_KD * change) >> 8);
+	applied = output;
+	if (applied > speedOutput + SPEED_SLEW) {
+		applied = speedOutput + SPEED_SLEW;
+	} else if (applied < speedOutput - SPEED_SLEW) {
+		applied = speedOutput - SPEED_SLEW;
+	}
+	if (applied > (int32_t)MOTOR_TOP) {
+		applied = (int32_t)MOTOR_TOP;
+	} else if (applied < 0) {
+		applied = 0;
+	}
+	/* While the output is limited the integral tracks it instead, so it
+	 * cannot wind up and the loop carries on from the output applied.
 	 */
-	if (EXTENDED || NORMAL) {
-		startSystem();
+	if (applied != output) {
+		integral = (applied - speedFeedForward) * 256 - SPEED_KP * error + SPEED_KD * change;
+	}
+	speedIntegral = integral;
+	speedOutput = applied;
+
+	MOTOR_TIMSK = (0 << MOTOR_TOIE);
+	shadow.duty = MOTOR_TOP - speedOutput;
+	MOTOR_TIFR = (1 << MOTOR_TOV);
+	MOTOR_TIMSK = (1 << MOTOR_TOIE);
+	return EVENT_NONE;
+}
+#endif
+
+/* Actions, indexed by ACTION_* */
+uint8_t (*const actions[ACTION_COUNT])(void) = {
+	actionNone,
+	actionStart,
+	actionTick,
+	actionInput,
+	actionReset,
+	actionFinish,
+	actionPause,
+	actionResume,
+	actionLateTick,
+#ifdef SPEED_CONTROL
+	actionControl,
+#else
+	actionNone, // EVENT_CONTROL is only posted with SPEED_CONTROL
+#endif
+};
+
+/* Shorthand for the transition table: S(next, action) */
+#define S(next, action) {STATE_##next, ACTION_##action}
+
+/* Transition table, indexed by state and event. Every event is listed
+ * for every state, so the machine can only ever move between the
+ * states below; an event that means nothing in a state leaves it
+ * there with no action. The host driver checks the table as a whole.
+ */
+const struct transition transitions[STATE_COUNT][EVENT_COUNT] PROGMEM = {
+	[STATE_IDLE] = {
+		[EVENT_NONE] = S(IDLE, NONE),
+		[EVENT_TICK] = S(IDLE, NONE),
+		[EVENT_START] = S(IDLE, START),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(IDLE, NONE),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(IDLE, NONE),
+		[EVENT_FAULT] = S(IDLE, NONE),
+		[EVENT_MODE] = S(IDLE, NONE),
+		[EVENT_CONTROL] = S(IDLE, NONE),
+	},
+	[STATE_WASH] = {
+		[EVENT_NONE] = S(WASH, NONE),
+		[EVENT_TICK] = S(WASH, TICK),
+		[EVENT_START] = S(PAUSED, PAUSE),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(WASH, INPUT),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(FINISHED, FINISH),
+		[EVENT_FAULT] = S(ERROR, PAUSE),
+		[EVENT_MODE] = S(WASH, NONE),
+		[EVENT_CONTROL] = S(WASH, CONTROL),
+	},
+	[STATE_RINSE] = {
+		[EVENT_NONE] = S(RINSE, NONE),
+		[EVENT_TICK] = S(RINSE, TICK),
+		[EVENT_START] = S(PAUSED, PAUSE),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(RINSE, INPUT),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(FINISHED, FINISH),
+		[EVENT_FAULT] = S(ERROR, PAUSE),
+		[EVENT_MODE] = S(RINSE, NONE),
+		[EVENT_CONTROL] = S(RINSE, CONTROL),
+	},
+	[STATE_SPIN] = {
+		[EVENT_NONE] = S(SPIN, NONE),
+		[EVENT_TICK] = S(SPIN, TICK),
+		[EVENT_START] = S(PAUSED, PAUSE),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(SPIN, INPUT),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(FINISHED, FINISH),
+		[EVENT_FAULT] = S(ERROR, PAUSE),
+		[EVENT_MODE] = S(SPIN, NONE),
+		[EVENT_CONTROL] = S(SPIN, CONTROL),
+	},
+	[STATE_FINISHED] = {
+		[EVENT_NONE] = S(FINISHED, NONE),
+		[EVENT_TICK] = S(FINISHED, NONE),
+		[EVENT_START] = S(IDLE, START),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(FINISHED, NONE),
+		[EVENT_WASH] = S(FINISHED, NONE),
+		[EVENT_RINSE] = S(FINISHED, NONE),
+		[EVENT_SPIN] = S(FINISHED, NONE),
+		[EVENT_DONE] = S(FINISHED, NONE),
+		[EVENT_FAULT] = S(FINISHED, NONE),
+		[EVENT_MODE] = S(FINISHED, NONE),
+		[EVENT_CONTROL] = S(FINISHED, NONE),
+	},
+	[STATE_ERROR] = {
+		[EVENT_NONE] = S(ERROR, NONE),
+		[EVENT_TICK] = S(ERROR, LATE_TICK),
+		[EVENT_START] = S(ERROR, NONE),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(ERROR, RESUME),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(FINISHED, FINISH),
+		[EVENT_FAULT] = S(ERROR, NONE),
+		[EVENT_MODE] = S(ERROR, NONE),
+		[EVENT_CONTROL] = S(ERROR, NONE),
+	},
+	/* Ticks already posted when the program was paused have been
+	 * counted in full, so they are still run. Resuming raises the
+	 * event for the phase the program is in.
+	 */
+	[STATE_PAUSED] = {
+		[EVENT_NONE] = S(PAUSED, NONE),
+		[EVENT_TICK] = S(PAUSED, LATE_TICK),
+		[EVENT_START] = S(PAUSED, RESUME),
+		[EVENT_RESET] = S(IDLE, RESET),
+		[EVENT_INPUT] = S(PAUSED, NONE),
+		[EVENT_WASH] = S(WASH, NONE),
+		[EVENT_RINSE] = S(RINSE, NONE),
+		[EVENT_SPIN] = S(SPIN, NONE),
+		[EVENT_DONE] = S(FINISHED, FINISH),
+		[EVENT_FAULT] = S(ERROR, NONE),
+		[EVENT_MODE] = S(PAUSED, NONE),
+		[EVENT_CONTROL] = S(PAUSED, NONE),
+	},
+};
+
+#undef S
+
+/* dispatch function. Argument is the event to handle. Looks up the
+ * transition for the current state, moves to its next state and runs
+ * its action, then does the same for any event the action raises, so
+ * each event runs to completion before the next is taken.
+ */
+void dispatch(uint8_t event) {
+	while (event != EVENT_NONE) {
+		const struct transition *t = &transitions[state][event];
+		uint8_t action = pgm_read_byte(&t->action);
+		state = pgm_read_byte(&t->next);
+		event = actions[action]();
+	}
+}
+
+/* resumeProgram function. Argument is a checkpoint record. If it shows
+ * a program running, and its phase and program clock agree, carries on
+ * with that program from there as it was: running, paused with the
+ * start button, or paused by a water level error if there is one now
+ * (with LEVEL_ADC, once the first level has been read). The switches
+ * may have been changed since, but the program latched when it was
+ * started keeps running. A user program is run from its start to the
+ * phase the clock is in, within the same bounded time at every boot as
+ * its length is. Returns 1 if it did.
+ */
+uint8_t resumeProgram(const struct checkpoint *record) {
+	if ((record->program & ~CHECKPOINT_USER) == 0) {
+		latchProgram(normalProgram);
+	} else if ((record->program & ~CHECKPOINT_USER) == 1) {
+		latchProgram(extendedProgram);
+	} else {
+		return 0;
+	}
+	// find the phase the clock is in, which must be the one recorded (of the same program)
+	while (run.current.duration != 0 && run.phaseEnd <= record->clock) {
+		nextPhase();
+	}
+	if (run.current.duration == 0 || run.index != record->phase || programNumber() != record->program) {
+		run.program = 0;
+		return 0;
+	}
+
+	setPowerState(POWER_RUNNING);
+	timeCounter = (uint8_t)record->clock;
+	timeCounterHigh = record->clock >> 8;
+#ifdef SPEED_CONTROL
+	speedStart();
+#endif
+	outputPhase();
+	tickStart();
+	recordRun(0);
+	dispatch(phaseEvent());
+	if (record->paused) {
+		dispatch(EVENT_START);
+	}
+#ifndef LEVEL_ADC
+	// with LEVEL_ADC the level is not read yet: the ADC ISR raises the fault once it is
+	else if (inputs.error) {
+		dispatch(EVENT_FAULT);
+	}
+#endif
+	return 1;
+}
+
+/* restoreCheckpoint function. Called once at boot, after setup() and
+ * before interrupts are enabled. Finds the newest valid checkpoint,
+ * reading every slot once whatever is in them, so it takes the same
+ * bounded time each boot, and carries on with the program it records.
+ * After a watchdog reset the run context left in SRAM is used instead
+ * if it is intact, so no ticks are run again. With USER_PROGRAMS the
+ * user programs are read first, as the program may be one of them.
+ */
+void restoreCheckpoint(void) {
+	struct checkpoint record;
+	struct checkpoint newest = {.program = CHECKPOINT_NO_PROGRAM};
+	uint8_t found = 0;
+	uint8_t slot;
+
+#ifdef USER_PROGRAMS
+	loadUserPrograms();
+#endif
+	checkpointSlot = 0;
+	checkpointBusy = 0;
+	checkpointQueued = 0;
+	for (slot = 0; slot < CHECKPOINT_SLOTS; slot++) {
+		eeprom_read_block(&record, (const void *)(uintptr_t)(CHECKPOINT_BASE + slot * CHECKPOINT_SIZE), CHECKPOINT_SIZE);
+		if (crc8((const uint8_t *)&record, CHECKPOINT_SIZE - 1) != record.crc) {
+			continue;
+		}
+		if (!found || (int16_t)(record.sequence - newest.sequence) > 0) {
+			newest = record;
+			found = 1;
+			checkpointSlot = (slot + 1) & (CHECKPOINT_SLOTS - 1); // the oldest record
+		}
+	}
+	checkpointSequence = newest.sequence;
+	checkpointProgram = newest.program;
+	if ((resetFlags & (1 << WDRF))
+		&& crc8((const uint8_t *)&recovery, CHECKPOINT_SIZE - 1) == recovery.crc) {
+		newest = recovery;
+	}
+	if (!resumeProgram(&newest)) {
+		recordRun(0);
+		if (checkpointProgram != CHECKPOINT_NO_PROGRAM) {
+			saveCheckpoint(); // the program recorded last is not carried on
+		}
+	}
+}
+
+#ifdef SHELL
+/* Command table: each command's name and the fewest and most
+ * arguments it takes, in the order of the SHELL_* numbers;
+ * shellHandlers (below) has its handler.
+ */
+struct shellCommand {
+	char name[SHELL_NAME_SIZE];
+	uint8_t least;
+	uint8_t most;
+};
+const struct shellCommand shellCommands[SHELL_COMMANDS] PROGMEM = {
+	[SHELL_STATE] = {"state", 0, 0},
+	[SHELL_START] = {"start", 0, 0},
+	[SHELL_RESET] = {"reset", 0, 0},
+	[SHELL_PHASE] = {"phase", 1, 1},
+	[SHELL_DUTY] = {"duty", 2, 2},
+	[SHELL_COUNTERS] = {"counters", 0, 0},
+	[SHELL_HELP] = {"help", 0, 0},
+#ifdef USER_PROGRAMS
+	[SHELL_EDIT] = {"edit", 1, 1},
+	[SHELL_CODE] = {"code", 1, SHELL_ARGUMENTS},
+	[SHELL_SAVE] = {"save", 0, 0},
+	[SHELL_ERASE] = {"erase", 1, 1},
+#endif
+};
+// state names, as the STATE_* numbers
+const char shellStates[STATE_COUNT][SHELL_NAME_SIZE] PROGMEM = {
+	"idle", "wash", "rinse", "spin", "finished", "error", "paused",
+};
+
+/* replyText function. Argument is a string in flash. Adds it to the
+ * reply, as much of it as fits.
+ */
+void replyText(const char *text) {
+	char c;
+	while ((c = pgm_read_byte(text++)) != 0 && shellReplyLength < TELEMETRY_PAYLOAD_MAX) {
+		shellReply[shellReplyLength++] = c;
+	}
+}
+
+/* replyNumber function. Argument is a number. Adds it to the reply in
+ * decimal, after a space.
+ */
+void replyNumber(uint16_t number) {
+	char digits[7];
+	uint8_t i = sizeof(digits) - 1;
+	digits[i] = 0;
+	do {
+		digits[--i] = '0' + number % 10;
+		number /= 10;
+	} while (number != 0);
+	digits[--i] = ' ';
+	while (digits[i] != 0 && shellReplyLength < TELEMETRY_PAYLOAD_MAX) {
+		shellReply[shellReplyLength++] = digits[i++];
 	}
-	// checking if system is finished
-	if (finished == 1) {
-		finished = 0; // resets system finished variable if the system is restarted
+}
+
+/* replyError function. Argument is why the command failed, in flash.
+ * Makes that the reply and counts the failure.
+ */
+void replyError(const char *why) {
+	shellReplyLength = TELEMETRY_TEXT;
+	replyText(PSTR("error: "));
+	replyText(why);
+	shellErrors++;
+}
+
+/* shellState function. Replies with the state and, if a program is
+ * running, the program, its phase and the program clock.
+ */
+void shellState(const uint16_t *arguments, uint8_t count) {
+	(void)arguments;
+	(void)count;
+	replyText(shellStates[state]);
+	if (run.program != 0) {
+#ifdef USER_PROGRAMS
+		if (run.code != 0) {
+			replyText(PSTR(" user"));
+		}
+#endif
+		replyText(run.program == extendedProgram ? PSTR(" extended phase") : PSTR(" normal phase"));
+		replyNumber(run.index);
+		replyText(PSTR(" clock"));
+		replyNumber(programClock());
 	}
 }
 
-ISR(INT1_vect) {
-	reset(); // reseting system if B1 is pressed
-	finished = 0; // indicates cycle is not finished
+/* shellStart function. Presses the start button. */
+void shellStart(const uint16_t *arguments, uint8_t count) {
+	dispatch(EVENT_START);
+	shellState(arguments, count);
 }
 
+/* shellReset function. Presses the reset button. */
+void shellReset(const uint16_t *arguments, uint8_t count) {
+	dispatch(EVENT_RESET);
+	shellState(arguments, count);
+}
+
+/* shellPhase function. Argument is a phase of the running program.
+ * Carries on with the program from the start of that phase, as if it
+ * had just got there.
+ */
+void shellPhase(const uint16_t *arguments, uint8_t count) {
+	struct runContext running = run;
+	uint16_t phaseStart;
+
+	if (state < STATE_WASH || state > STATE_SPIN) {
+		replyError(PSTR("no program running"));
+		return;
+	}
+	latchProgram(run.program);
+	while (run.current.duration != 0 && run.index != arguments[0]) {
+		nextPhase();
+	}
+	if (run.current.duration == 0) {
+		run = running;
+		replyError(PSTR("no such phase"));
+		return;
+	}
+	phaseStart = run.phaseEnd - run.current.duration;
+	timeCounter = (uint8_t)phaseStart; // only the main loop changes the clock
+	timeCounterHigh = phaseStart >> 8;
+	outputPhase();
+	recordRun(0);
+	saveCheckpoint();
+	dispatch(phaseEvent());
+	shellState(arguments, count);
+}
+
+/* shellDuty function. Arguments are a pwm[] level and a duty cycle in
+ * percent. Sets the level to that duty, at once if a program is running.
+ */
+void shellDuty(const uint16_t *arguments, uint8_t count) {
+	uint8_t i;
+	(void)count;
+	if (arguments[0] >= sizeof(pwm) / sizeof(pwm[0]) || arguments[1] > 100) {
+		replyError(PSTR("bad duty"));
+		return;
+	}
+	pwm[arguments[0]] = MOTOR_TOP - (motorProduct_t)MOTOR_TOP * arguments[1] / 100;
+	if (state >= STATE_WASH && state <= STATE_SPIN) {
+		outputPhase();
+	}
+	replyText(PSTR("pwm"));
+	for (i = 0; i < sizeof(pwm) / sizeof(pwm[0]); i++) {
+		replyNumber(pwm[i]);
+	}
+}
+
+/* shellCounters function. Replies with the events, frames and
+ * characters lost, the command lines that failed, the sequence number
+ * of the last checkpoint and the flags of the last reset.
+ */
+void shellCounters(const uint16_t *arguments, uint8_t count) {
+	(void)arguments;
+	(void)count;
+	replyText(PSTR("events"));
+	replyNumber(eventsLost);
+	replyText(PSTR(" frames"));
+	replyNumber(telemetryLost);
+	replyText(PSTR(" chars"));
+	replyNumber(shellDropped);
+	replyText(PSTR(" errors"));
+	replyNumber(shellErrors);
+	replyText(PSTR(" checkpoint"));
+	replyNumber(checkpointSequence);
+	replyText(PSTR(" reset"));
+	replyNumber(resetFlags);
+}
+
+/* shellHelp function. Replies with the name of every command. */
+void shellHelp(const uint16_t *arguments, uint8_t count) {
+	uint8_t i;
+	(void)arguments;
+	(void)count;
+	for (i = 0; i < SHELL_COMMANDS; i++) {
+		if (i != 0) {
+			replyText(PSTR(" "));
+		}
+		replyText(shellCommands[i].name);
+	}
+}
+
+#ifdef USER_PROGRAMS
+/* userUploadFree function. Returns 0 if a user program can be saved or
+ * erased now, or why not as a string in flash: not while a program
+ * runs (it may be that one), or while the last one saved is still being
+ * written.
+ */
+const char *userUploadFree(void) {
+	if (run.program != 0) {
+		return PSTR("program running");
+	}
+	if (userWriteByte != USER_RECORD_SIZE) {
+		return PSTR("eeprom busy");
+	}
+	return 0;
+}
+
+/* shellEdit function. Argument is a mode (0 = normal, 1 = extended).
+ * Starts a new, empty user program for it.
+ */
+void shellEdit(const uint16_t *arguments, uint8_t count) {
+	(void)count;
+	if (arguments[0] > 1) {
+		replyError(PSTR("bad mode"));
+		return;
+	}
+	userEditing = arguments[0];
+	userUpload.length = 0;
+	replyText(PSTR("editing"));
+	replyNumber(userEditing);
+}
+
+/* shellCode function. Arguments are bytes of bytecode. Adds them to
+ * the user program being edited.
+ */
+void shellCode(const uint16_t *arguments, uint8_t count) {
+	uint8_t i;
+	if (userEditing == USER_NOT_EDITING) {
+		replyError(PSTR("not editing"));
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		if (arguments[i] > 255) {
+			replyError(PSTR("bad byte"));
+			return;
+		}
+	}
+	if (userUpload.length + count > USER_PROGRAM_SIZE) {
+		replyError(PSTR("program too long"));
+		return;
+	}
+	for (i = 0; i < count; i++) {
+		userUpload.code[userUpload.length++] = arguments[i];
+	}
+	replyText(PSTR("bytes"));
+	replyNumber(userUpload.length);
+}
+
+/* shellSave function. Checks the user program being edited and, if it
+ * passes, runs it from now on in place of the built-in program for its
+ * mode, and stores it in EEPROM.
+ */
+void shellSave(const uint16_t *arguments, uint8_t count) {
+	const char *why;
+	uint16_t ticks;
+	(void)arguments;
+	(void)count;
+	if (userEditing == USER_NOT_EDITING) {
+		replyError(PSTR("not editing"));
+		return;
+	}
+	if ((why = userUploadFree()) != 0 || (why = checkProgram(&userUpload, &ticks)) != 0) {
+		replyError(why);
+		return;
+	}
+	userPrograms[userEditing] = userUpload;
+	saveUserProgram(userEditing);
+	replyText(PSTR("saved"));
+	replyNumber(userEditing);
+	replyText(PSTR(","));
+	replyNumber(userUpload.length);
+	replyText(PSTR(" bytes"));
+	replyNumber(ticks);
+	replyText(PSTR(" ticks"));
+	userEditing = USER_NOT_EDITING;
+}
+
+/* shellErase function. Argument is a mode (0 = normal, 1 = extended).
+ * Goes back to the built-in program for it, removing its user program
+ * from EEPROM.
+ */
+void shellErase(const uint16_t *arguments, uint8_t count) {
+	const char *why;
+	(void)count;
+	if (arguments[0] > 1) {
+		replyError(PSTR("bad mode"));
+		return;
+	}
+	if ((why = userUploadFree()) != 0) {
+		replyError(why);
+		return;
+	}
+	userPrograms[arguments[0]].length = 0;
+	saveUserProgram(arguments[0]);
+	replyText(PSTR("erased"));
+	replyNumber(arguments[0]);
+}
+#endif
+
+/* Handlers, in the order of the SHELL_* numbers. Each has the command's
+ * arguments and how many there are, and fills in the reply.
+ */
+void (*const shellHandlers[SHELL_COMMANDS])(const uint16_t *arguments, uint8_t count) = {
+	[SHELL_STATE] = shellState,
+	[SHELL_START] = shellStart,
+	[SHELL_RESET] = shellReset,
+	[SHELL_PHASE] = shellPhase,
+	[SHELL_DUTY] = shellDuty,
+	[SHELL_COUNTERS] = shellCounters,
+	[SHELL_HELP] = shellHelp,
+#ifdef USER_PROGRAMS
+	[SHELL_EDIT] = shellEdit,
+	[SHELL_CODE] = shellCode,
+	[SHELL_SAVE] = shellSave,
+	[SHELL_ERASE] = shellErase,
+#endif
+};
+
+/* shellCommand function. Arguments are a command line and its length.
+ * Looks its first word up in the command table, reads the arguments
+ * after it and runs the command, or replies with what is wrong.
+ */
+void shellCommand(const uint8_t *line, uint8_t length) {
+	uint16_t arguments[SHELL_ARGUMENTS];
+	uint8_t count = 0;
+	uint8_t i = 0;
+	uint8_t end;
+	uint8_t command;
+	uint8_t c;
+	char letter;
+
+	while (i < length && line[i] == ' ') {
+		i++;
+	}
+	for (end = i; end < length && line[end] != ' '; end++) {
+		;
+	}
+	for (command = 0; command < SHELL_COMMANDS; command++) {
+		const char *name = shellCommands[command].name;
+		// stop at the end of the name, so a 0 in the line cannot read past it
+		for (c = 0; i + c < end; c++) {
+			letter = pgm_read_byte(&name[c]);
+			if (letter == 0 || letter != line[i + c]) {
+				break;
+			}
+		}
+		if (i + c == end && pgm_read_byte(&name[c]) == 0) {
+			break;
+		}
+	}
+	if (command == SHELL_COMMANDS) {
+		replyError(PSTR("unknown command"));
+		return;
+	}
+	for (i = end; i < length; ) {
+		if (line[i] == ' ') {
+			i++;
+			continue;
+		}
+		if (count == SHELL_ARGUMENTS) {
+			replyError(PSTR("bad arguments"));
+			return;
+		}
+		arguments[count] = 0;
+		for (; i < length && line[i] != ' '; i++) {
+			// 0 - 65535: the next digit must not carry the number past 16 bits
+			if (line[i] < '0' || line[i] > '9' || arguments[count] > 6553
+				|| (arguments[count] == 6553 && line[i] > '5')) {
+				replyError(PSTR("bad arguments"));
+				return;
+			}
+			arguments[count] = arguments[count] * 10 + (line[i] - '0');
+		}
+		count++;
+	}
+	if (count < pgm_read_byte(&shellCommands[command].least)
+		|| count > pgm_read_byte(&shellCommands[command].most)) {
+		replyError(PSTR("bad arguments"));
+		return;
+	}
+	shellHandlers[command](arguments, count);
+}
+
+/* runShell function. Runs the command line the receive ISR has
+ * collected, if there is one, once no events are waiting and the
+ * telemetry queue has room for the reply, and sends the reply. Returns
+ * 1 if it ran a command.
+ */
+uint8_t runShell(void) {
+	if (!shellReady || eventHead != eventTail || telemetryRoom() < SHELL_ROOM) {
+		return 0;
+	}
+	restartIdleTimeout(); // someone is using the shell
+	shellReply[TELEMETRY_TYPE] = TELEMETRY_REPLY;
+	shellReplyLength = TELEMETRY_TEXT;
+	if (shellBad) {
+		replyError(PSTR("bad line"));
+	} else {
+		shellCommand(shellLine, shellLength);
+	}
+	sendFrame(shellReply, shellReplyLength);
+	shellLength = 0;
+	shellBad = 0;
+	shellReady = 0; // the ISR may fill the line again
+	return 1;
+}
+#endif
+
+/* updateFrame function. Fills the frame buffer with the appropriate 
+ * water level output (right display) and mode select output (left display).
+ */
+void updateFrame(void) {
+	uint8_t finished = (state == STATE_FINISHED);
+	display(inputs.level, 0, finished);
+	if (inputs.mode == 1) {
+		display(3, 1, finished);
+	} else {
+		display(4, 1, finished);
+	}
+}
+
+/* feedWatchdog function. Feeds the watchdog if every subsystem that
+ * should be running has shown progress since it was last fed.
+ */
+void feedWatchdog(void) {
+	uint8_t required = PROGRESS_ALWAYS;
+	if (state >= STATE_WASH && state <= STATE_SPIN) {
+		required |= PROGRESS_TICK;
+	}
+	ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+		if ((progress & required) == required) {
+			wdt_reset();
+			progress = 0;
+		}
+	}
+}
+
+/* processEvents function. Handles every event the ISRs have queued, in
+ * order (with TELEMETRY, sending a status frame after each tick and
+ * change of state) and with SHELL then any command line received, then
+ * brings the frame buffer up to date and feeds the watchdog. Called
+ * from the main loop each time an interrupt wakes it.
+ */
+void processEvents(void) {
+	uint8_t event;
+	uint8_t handled = 0;
+#ifdef TELEMETRY
+	uint8_t before;
+#endif
+	while ((event = takeEvent()) != EVENT_NONE) {
+#ifdef TELEMETRY
+		before = state;
+		dispatch(event);
+		if (event == EVENT_TICK || state != before) {
+			sendTelemetry();
+		}
+#else
+		dispatch(event);
+#endif
+		handled = 1;
+	}
+#ifdef SHELL
+	before = state;
+	if (runShell()) {
+		if (state != before) {
+			sendTelemetry();
+		}
+		handled = 1;
+	}
+#endif
+	if (handled) {
+		updateFrame();
+	}
+	feedWatchdog();
+}
+
+/* powerDown function. Blanks the display and puts the MCU into
+ * power-down until the start or reset button is pressed. Edges on INT0
+ * and INT1 need the I/O clock, which is stopped in power-down, so the
+ * buttons wake the MCU through their pin change interrupt instead.
+ * The press itself is then picked up by the button debouncing once
+ * the display refresh is running again.
+ * Must be called with interrupts disabled.
+ */
+void powerDown(void) {
+	TIMSK2 = (0 << OCIE2A); // stop refreshing the display
+	PORTA = 0; // blank both digits
+#ifdef LEVEL_ADC
+	ADCSRA = 0; // the ADC stops in power-down; switch it off altogether
+#endif
+	PCIFR = (1 << PCIF3); // clear any changes from earlier presses
+	PCICR = (1 << PCIE3); // wake on B0 or B1
+	wdt_disable(); // nothing runs to feed it
+	set_sleep_mode(SLEEP_MODE_PWR_DOWN);
+	sleep_enable();
+	sei(); // the instruction after sei() runs first, so no wake up is missed
+	sleep_cpu();
+	sleep_disable();
+	progress = 0;
+	wdt_enable(WATCHDOG_TIMEOUT);
+	TIMSK2 = (1 << OCIE2A); // the button ISR has run, refresh the display again
+#ifdef LEVEL_ADC
+	levelStart();
+#endif
+}
+
+/* enterSleep function. Called from the main loop once the frame buffer is
+ * up to date. Sleeps in idle mode until the next interrupt (at the
+ * latest the next display refresh), or powers down if the idle
+ * timeout has run out.
+ */
+void enterSleep(void) {
+	cli();
+	// an ISR posted an event after the main loop last checked, handle it first
+	if (eventHead != eventTail) {
+		sei();
+		return;
+	}
+	// the EEPROM ready interrupt cannot wake the MCU, so finish any checkpoint first
+	if (idleCountdown == 0 && (EECR & (1 << EERIE)) == 0
+#ifdef TELEMETRY
+		&& (UCSR0B & (1 << UDRIE0)) == 0 // and the USART stops, so send the last frame
+#endif
+		) {
+		powerDown();
+	} else {
+		set_sleep_mode(SLEEP_MODE_IDLE);
+		sleep_enable();
+		sei();
+		sleep_cpu();
+		sleep_disable();
+	}
+}
+
+/* On the host the driver in hal_host.c provides main() and calls
+ * setup(), the ISRs and processEvents() itself.
+ */
+#ifndef HAL_HOST
+int main(void) {
+	setup();
+	// carry on with a program a power cut interrupted
+	restoreCheckpoint();
+
+	/* Turn on global interrupts */
+	sei();
+
+	/* The ISRs only post events; the main loop handles them (including
+	 * rebuilding the frame buffer the Timer 2 ISR displays) and sleeps
+	 * in between.
+	 */
+	updateFrame();
+	while(1) {
+		processEvents();
+		enterSleep();
+	}
+}
+#endif
+
+/* The pin change interrupt of B0 and B1 is only enabled in power-down.
+ * Waking up is all it has to do, so it just switches itself off again
+ * and restarts the idle timeout.
+ */
+ISR(PCINT3_vect) {
+	PCICR = (0 << PCIE3);
+	idleCountdown = IDLE_REFRESHES;
+}
+
+#ifndef MOTOR_PWM_TIMER1
 ISR(TIMER1_COMPA_vect) {
-	if (EXTENDED) { 
-		// add 1 to counter every time clock counter restarts.
-		timeCounter += 1;
-		/* timer counter is increased 32 times every 6 seconds. 
-		 * Hence each cycle is 32 long.
-		 */
-		if (timeCounter < 32) {
-			PORTC = washCycle(timeCounter);
-		} else if (timeCounter < 96) {
-			OCR0B = pwm[1]; // changes PWM values to 50%
-			PORTC = rinseCycle(timeCounter);
-		} else if (timeCounter < 128) {
-			OCR0B = pwm[2]; // changes PWM values to 90%
-			PORTC = spinCycle(timeCounter);
-		} else {
-			reset();
-			finished = 1; // indicates system has finished
+	/* In CTC mode OCR1A is not buffered, so the new value takes effect
+	 * for the tick that has just begun.
+	 */
+#ifdef SPEED_CONTROL
+	tachoBase += OCR1A + 1; // the counts of the tick that has just ended
+#endif
+	OCR1A = nextTickCompare();
+	// the main loop advances the program
+	postEvent(EVENT_TICK);
+	progress |= PROGRESS_TICK;
+}
+#endif
+
+#ifdef SPEED_CONTROL
+/* Timestamps each tacho pulse. Timer 1 restarts from 0 every tick, so
+ * tachoBase is added to ICR1. This ISR takes priority over the compare
+ * match one, so a pulse just after a tick has ended may be seen before
+ * tachoBase has been moved on; that tick's counts are added here.
+ * A pulse captured with Timer 1 stopped (paused) gives no period, and
+ * one less than TACHO_MIN_PERIOD after the last is dropped as a glitch.
+ */
+ISR(TIMER1_CAPT_vect) {
+	uint16_t capture = ICR1;
+	uint16_t now = tachoBase + capture;
+	if ((TIFR1 & (1 << OCF1A)) && capture < TICK_BASE / 2) {
+		now += OCR1A + 1;
+	}
+	if (!tachoValid) {
+		tachoLast = now;
+		tachoValid = 1;
+	} else if ((uint16_t)(now - tachoLast) >= TACHO_MIN_PERIOD) {
+		tachoPeriod = now - tachoLast;
+		tachoFresh = 1;
+		tachoLast = now;
+	}
+}
+#endif
+
+/* Commits the outputs queued by outputPhase(). PORTC changes straight
+ * away; a new motor duty starts a ramp, which this ISR then moves along
+ * one curve step every RAMP_PERIODS_PER_STEP overflows. Every overflow
+ * costs the same whatever the curve, and the motor compare register is
+ * double buffered in both PWM modes, so each value starts with the
+ * next PWM period.
+ */
+ISR(MOTOR_OVF_vect) {
+#ifdef SPEED_CONTROL
+	// the speed loop limits how fast the duty changes, so it is committed as it is
+	PORTC = shadow.leds;
+	MOTOR_OCR = shadow.duty;
+	MOTOR_TIMSK = (0 << MOTOR_TOIE);
+#else
+	motor_t offset;
+	PORTC = shadow.leds;
+	if (shadow.duty != rampTo) {
+		// a new duty level: ramp to it from wherever the compare value is now
+		rampFrom = MOTOR_OCR;
+		rampTo = shadow.duty;
+		rampRising = (rampTo > rampFrom);
+		rampSize = rampRising ? rampTo - rampFrom : rampFrom - rampTo;
+		rampStep = 0;
+		rampCountdown = 1;
+	}
+	if (rampStep == RAMP_STEPS) {
+		MOTOR_TIMSK = (0 << MOTOR_TOIE); // outputs committed and no ramp running
+		return;
+	}
+	if (--rampCountdown != 0) {
+		return;
+	}
+	rampCountdown = RAMP_PERIODS_PER_STEP;
+	rampStep++;
+	if (rampStep == RAMP_STEPS) {
+		MOTOR_OCR = rampTo;
+		MOTOR_TIMSK = (0 << MOTOR_TOIE);
+		return;
+	}
+	offset = ((motorProduct_t)rampSize * pgm_read_byte(&rampCurve[rampStep])) >> 8;
+	MOTOR_OCR = rampRising ? rampFrom + offset : rampFrom - offset;
+#endif
+}
+
+ISR(TIMER2_COMPA_vect) {
+	// show the next digit from the frame buffer
+	PORTA = frame[digit];
+	digit = 1 - digit;
+	progress |= PROGRESS_DISPLAY;
+	// the one read of the switches and buttons for this refresh
+	uint8_t pind = PIND;
+	uint8_t buttons = debounceButtons(pind);
+	sampleInputs(pind);
+	if (buttons & START_PRESSED) {
+		postEvent(EVENT_START);
+	}
+	if (buttons & RESET_PRESSED) {
+		postEvent(EVENT_RESET);
+	}
+	// count down to power-down while no program is running
+	if (powerState != POWER_RUNNING && idleCountdown != 0) {
+		idleCountdown--;
+	}
+#ifdef MOTOR_PWM_TIMER1
+	// program ticks are counted in display refreshes
+	if (tickRunning && --tickCountdown == 0) {
+		tickCountdown = nextTickCompare() + 1;
+		postEvent(EVENT_TICK);
+		progress |= PROGRESS_TICK;
+	}
+#endif
+#ifdef SPEED_CONTROL
+	// the speed loop runs SPEED_CONTROL_HZ times a second while a program runs
+	if (--controlCountdown == 0) {
+		controlCountdown = SPEED_CONTROL_REFRESHES;
+		if (powerState == POWER_RUNNING) {
+			postEvent(EVENT_CONTROL);
 		}
-	} else if (NORMAL) {
-		// add 1 to counter every time clock counter restarts.
-		timeCounter += 1;
-		/* timer counter is increased 32 times every 6 seconds. 
-		 * Hence each cycle is 32 long.
-		 */
-		if (timeCounter < 32) {
-			PORTC = washCycle(timeCounter);
-		} else if (timeCounter < 64) {
-			OCR0B = pwm[1]; // changes PWM values to 50%
-			PORTC = rinseCycle(timeCounter);
-		} else if (timeCounter < 96) {
-			OCR0B = pwm[2]; // changes PWM values to 90%
-			PORTC = spinCycle(timeCounter);
+	}
+#endif
+}
+
+/* eepromUpdate function. Arguments are an EEPROM address and a value.
+ * Starts writing the value there, unless the byte already holds it,
+ * which saves both time and wear. Only called from the EEPROM ready ISR.
+ */
+void eepromUpdate(uint16_t address, uint8_t value) {
+	if (eeprom_read_byte((const uint8_t *)(uintptr_t)address) != value) {
+		EEAR = address;
+		EEDR = value;
+		EECR |= (1 << EEMPE); // erase and write, EEPE within 4 cycles
+		EECR |= (1 << EEPE);
+	}
+}
+
+/* Writes the checkpoint record in checkpointWriting to its slot, one
+ * byte each time the EEPROM is ready. Once the record is written the
+ * next slot is used for the queued record, if there is one, or the
+ * interrupt is switched off. With USER_PROGRAMS a user program being
+ * saved is written the same way, whenever no checkpoint is.
+ */
+ISR(EE_READY_vect) {
+#ifdef USER_PROGRAMS
+	if (!checkpointBusy) {
+		eepromUpdate(USER_PROGRAM_BASE + userWriteSlot * USER_RECORD_SIZE + userWriteByte,
+			((const uint8_t *)&userPrograms[userWriteSlot])[userWriteByte]);
+		if (++userWriteByte == USER_RECORD_SIZE) {
+			EECR &= ~(1 << EERIE);
+		}
+		return;
+	}
+#endif
+	eepromUpdate(CHECKPOINT_BASE + checkpointSlot * CHECKPOINT_SIZE + checkpointByte,
+		((const uint8_t *)&checkpointWriting)[checkpointByte]);
+	if (++checkpointByte != CHECKPOINT_SIZE) {
+		return;
+	}
+	checkpointByte = 0;
+	checkpointSlot = (checkpointSlot + 1) & (CHECKPOINT_SLOTS - 1);
+	if (checkpointQueued) {
+		checkpointWriting = checkpointNext;
+		checkpointQueued = 0;
+		return;
+	}
+	checkpointBusy = 0;
+#ifdef USER_PROGRAMS
+	if (userWriteByte != USER_RECORD_SIZE) {
+		return; // a user program is waiting to be saved
+	}
+#endif
+	EECR &= ~(1 << EERIE);
+}
+
+#ifdef TELEMETRY
+/* Sends the next queued telemetry byte each time the USART data
+ * register is empty, and switches the interrupt off once the queue is.
+ */
+ISR(USART0_UDRE_vect) {
+	uint8_t tail = telemetryTail;
+	if (tail == telemetryHead) {
+		UCSR0B = TELEMETRY_UCSRB;
+		return;
+	}
+	UDR0 = telemetryQueue[tail];
+	telemetryTail = (tail + 1) & (TELEMETRY_QUEUE_SIZE - 1);
+}
+#endif
+
+#ifdef SHELL
+/* Adds each character received to the command line, and marks the line
+ * complete at a carriage return or line feed. A line that overflows the
+ * buffer or has a character garbled on the way is still completed, so
+ * the shell can say it was bad; blank lines are ignored.
+ */
+ISR(USART0_RX_vect) {
+	uint8_t status = UCSR0A; // read before UDR0, which moves the FIFO on
+	uint8_t c = UDR0;
+	if (shellReady) {
+		shellDropped++;
+		return;
+	}
+	if (status & ((1 << FE0) | (1 << DOR0) | (1 << UPE0))) {
+		shellBad = 1;
+	}
+	if (c == '\r' || c == '\n') {
+		if (shellLength != 0 || shellBad) {
+			shellReady = 1;
+		}
+	} else if (shellLength == SHELL_LINE_SIZE) {
+		shellBad = 1;
+	} else {
+		shellLine[shellLength++] = c;
+	}
+}
+#endif
+
+#ifdef LEVEL_ADC
+/* Filters the water level. Most conversions only add to the sum; every
+ * LEVEL_OVERSAMPLE-th one completes a sample, which moves the average
+ * on and is quantized into a level, with hysteresis around the
+ * thresholds so a reading near one does not flicker between levels.
+ * Until the first sample the level is taken to be a sensor error;
+ * a first sample that confirms it raises EVENT_FAULT, for a program
+ * resumed at boot before the level could be read.
+ */
+ISR(ADC_vect) {
+	uint16_t sample;
+	uint16_t threshold;
+	uint8_t level;
+	uint8_t fresh;
+	uint8_t i;
+
+	levelSum += ADC;
+	if (--levelCount != 0) {
+		return;
+	}
+	levelCount = LEVEL_OVERSAMPLE;
+	sample = levelSum >> LEVEL_EXTRA_BITS; // LEVEL_OVERSAMPLE 10-bit conversions decimated to 12 bits
+	levelSum = 0;
+	fresh = levelFresh;
+	if (fresh) {
+		for (i = 0; i < LEVEL_AVERAGE; i++) {
+			levelSamples[i] = sample;
+		}
+		levelTotal = sample * LEVEL_AVERAGE;
+		levelFresh = 0;
+	}
+	levelTotal += sample - levelSamples[levelNext];
+	levelSamples[levelNext] = sample;
+	levelNext = (levelNext + 1) & (LEVEL_AVERAGE - 1);
+	levelFine = levelTotal / LEVEL_AVERAGE;
+	progress |= PROGRESS_LEVEL;
+
+	if (levelFine < LEVEL_OPEN || levelFine > LEVEL_SHORT) {
+		levelQuantized = 3;
+		if (fresh) {
+			// the level was taken as an error until now, so no change is latched
+			postEvent(EVENT_FAULT);
+		}
+		return;
+	}
+	level = 0;
+	for (i = 0; i < 2; i++) {
+		threshold = pgm_read_word(&levelThresholds[i]);
+		// a level already reached is only left once well clear of it
+		if (levelQuantized != 3 && levelQuantized > i) {
+			threshold -= LEVEL_HYSTERESIS;
 		} else {
-			reset();
-			finished = 1; // indicates system has finished
-		}	
+			threshold += LEVEL_HYSTERESIS;
+		}
+		if (levelFine >= threshold) {
+			level = i + 1;
+		}
 	}
+	levelQuantized = level;
 }
+#endif
@@ -0,0 +1,54 @@
+/*
+ * patterns.h
+ *
+ * LED patterns for the wash, rinse and spin cycles, indexed by
+ * pattern number and timeCounter % PATTERN_LENGTH, and the motor
+ * PWM soft-start curve.
+ *
+ * Generated by sim/gen_patterns.c - do not edit.
+ */
+
+#ifndef PATTERNS_H_
+#define PATTERNS_H_
+
+#define PATTERN_LENGTH 32
+#define PATTERN_COUNT 3
+
+#define WASH_PATTERN 0
+#define RINSE_PATTERN 1
+#define SPIN_PATTERN 2
+
+static const uint8_t ledPatterns[PATTERN_COUNT][PATTERN_LENGTH] PROGMEM = {
+	{
+		0x01, 0x01, 0x02, 0x02, 0x04, 0x04, 0x08, 0x08,
+		0x01, 0x01, 0x02, 0x02, 0x04, 0x04, 0x08, 0x08,
+		0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F,
+		0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F, 0x0F
+	},
+	{
+		0x08, 0x08, 0x04, 0x04, 0x02, 0x02, 0x01, 0x01,
+		0x08, 0x08, 0x04, 0x04, 0x02, 0x02, 0x01, 0x01,
+		0x0F, 0x0F, 0x00, 0x00, 0x0F, 0x0F, 0x00, 0x00,
+		0x0F, 0x0F, 0x00, 0x00, 0x0F, 0x0F, 0x00, 0x00
+	},
+	{
+		0x01, 0x01, 0x02, 0x02, 0x04, 0x04, 0x08, 0x08,
+		0x08, 0x08, 0x04, 0x04, 0x02, 0x02, 0x01, 0x01,
+		0x0F, 0x00, 0x0F, 0x00, 0x0F, 0x00, 0x0F, 0x00,
+		0x0F, 0x00, 0x0F, 0x00, 0x0F, 0x00, 0x0F, 0x00
+	}
+};
+
+/* Fraction of the way (in 256ths) from the old duty to the new one
+ * at the start of each ramp step.
+ */
+#define RAMP_STEPS 32
+
+static const uint8_t rampCurve[RAMP_STEPS] PROGMEM = {
+	0, 1, 3, 6, 11, 17, 24, 31,
+	40, 49, 59, 70, 81, 92, 104, 116,
+	128, 140, 152, 164, 175, 186, 197, 207,
+	216, 225, 232, 239, 245, 250, 253, 255
+};
+
+#endif /* PATTERNS_H_ */
@@ -0,0 +1,128 @@
+/*
+ * gen_patterns.c
+ *
+ * Generates patterns.h, the flash-resident LED pattern tables used by
+ * the wash, rinse and spin cycles. The functions below are the original
+ * pattern definitions; the tables are produced by evaluating them for
+ * every timeCounter value, so the firmware output is bit-identical
+ * while the ISR only has to do a table lookup.
+ *
+ * Every pattern repeats every 32 ticks, which is checked here before
+ * the header is written. The header also holds the soft-start curve
+ * the motor PWM follows from one duty level to the next.
+ *
+ * To change a pattern, edit it below and regenerate as a pre-build
+ * step:
+ *     gcc -o gen_patterns sim/gen_patterns.c && ./gen_patterns > patterns.h
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define PATTERN_LENGTH 32
+#define RAMP_STEPS 32
+
+/* L0 - L3 chase on every second tick, then all LEDs on. */
+static uint8_t washCycle(uint8_t timeCounter) {
+	if ((timeCounter / 2) % 16 < 8) {
+		return (1 << ((timeCounter / 2) % 4));
+	} else {
+		return 0b00001111;
+	}
+}
+
+/* L3 - L0 chase on every second tick, then all LEDs flashing
+ * (two ticks on, two ticks off).
+ */
+static uint8_t rinseCycle(uint8_t timeCounter) {
+	if ((timeCounter / 2) % 16 < 8) {
+		return (1 << (3 - ((timeCounter / 2) % 4)));
+	} else if (timeCounter % 4 < 2) {
+		return 0b00001111;
+	} else {
+		return 0b00000000;
+	}
+}
+
+/* L0 - L3 then L3 - L0 chase on every second tick, then all LEDs
+ * flashing every tick.
+ */
+static uint8_t spinCycle(uint8_t timeCounter) {
+	if ((timeCounter / 2) % 16 < 4) {
+		return (1 << ((timeCounter / 2) % 4));
+	} else if ((timeCounter / 2) % 16 < 8) {
+		return (1 << (3 - ((timeCounter / 2) % 4)));
+	} else if (timeCounter % 2 == 0) {
+		return 0b00001111;
+	} else {
+		return 0b00000000;
+	}
+}
+
+/* Soft-start curve: smoothstep (3x^2 - 2x^3), so the duty leaves the old
+ * level and arrives at the new one gently. Returns how far along the
+ * ramp (in 256ths) the duty is at the start of the given step.
+ */
+static uint8_t rampCurve(int step) {
+	double x = (double)step / RAMP_STEPS;
+	return (uint8_t)(256 * x * x * (3 - 2 * x) + 0.5);
+}
+
+struct pattern {
+	const char *name;
+	uint8_t (*output)(uint8_t timeCounter);
+};
+
+static const struct pattern patterns[] = {
+	{"WASH_PATTERN", washCycle},
+	{"RINSE_PATTERN", rinseCycle},
+	{"SPIN_PATTERN", spinCycle},
+};
+#define PATTERN_COUNT (sizeof(patterns) / sizeof(patterns[0]))
+
+int main(void) {
+	unsigned p;
+	int i;
+
+	for (p = 0; p < PATTERN_COUNT; p++) {
+		for (i = 0; i < 256; i++) {
+			if (patterns[p].output(i) != patterns[p].output(i % PATTERN_LENGTH)) {
+				fprintf(stderr, "gen_patterns: %s does not repeat every %d ticks\n",
+					patterns[p].name, PATTERN_LENGTH);
+				return 1;
+			}
+		}
+	}
+
+	printf("/*\n * patterns.h\n *\n"
+		" * LED patterns for the wash, rinse and spin cycles, indexed by\n"
+		" * pattern number and timeCounter %% PATTERN_LENGTH, and the motor\n"
+		" * PWM soft-start curve.\n *\n"
+		" * Generated by sim/gen_patterns.c - do not edit.\n */\n\n");
+	printf("#ifndef PATTERNS_H_\n#define PATTERNS_H_\n\n");
+	printf("#define PATTERN_LENGTH %d\n", PATTERN_LENGTH);
+	printf("#define PATTERN_COUNT %u\n\n", (unsigned)PATTERN_COUNT);
+	for (p = 0; p < PATTERN_COUNT; p++) {
+		printf("#define %s %u\n", patterns[p].name, p);
+	}
+	printf("\nstatic const uint8_t ledPatterns[PATTERN_COUNT][PATTERN_LENGTH] PROGMEM = {\n");
+	for (p = 0; p < PATTERN_COUNT; p++) {
+		printf("\t{");
+		for (i = 0; i < PATTERN_LENGTH; i++) {
+			printf("%s0x%02X%s", i % 8 ? " " : "\n\t\t", patterns[p].output(i),
+				i + 1 < PATTERN_LENGTH ? "," : "\n");
+		}
+		printf("\t}%s\n", p + 1 < PATTERN_COUNT ? "," : "");
+	}
+	printf("};\n\n");
+	printf("/* Fraction of the way (in 256ths) from the old duty to the new one\n"
+		" * at the start of each ramp step.\n */\n");
+	printf("#define RAMP_STEPS %d\n\n", RAMP_STEPS);
+	printf("static const uint8_t rampCurve[RAMP_STEPS] PROGMEM = {");
+	for (i = 0; i < RAMP_STEPS; i++) {
+		printf("%s%u%s", i % 8 ? " " : "\n\t", rampCurve(i),
+			i + 1 < RAMP_STEPS ? "," : "\n");
+	}
+	printf("};\n\n#endif /* PATTERNS_H_ */\n");
+	return 0;
+}
@@ -0,0 +1,554 @@
+/*
+ * isr_bench.c
+ *
+ * Cycle-accurate ISR benchmark for AVRProgrammingTask under simavr.
+ *
+ * Loads the firmware ELF, drives the PIND switches and buttons and
+ * steps the simulated core one instruction at a time. An ISR is taken
+ * to start when the program counter lands on its vector and to end
+ * when its RETI has executed; the cycles in between are recorded. The
+ * fixed 4 cycle interrupt response before the vector is not included.
+ *
+ * For TIMER1_COMPA_vect every one of the 256 timeCounter values is
+ * forced (by writing the variable as the ISR is entered) for each of
+ * the NORMAL, EXTENDED and error input combinations, and the worst
+ * case is reported against the display refresh period. The ISR now
+ * only posts an event, so the sweep should come out flat; it is kept
+ * so any work creeping back into the ISR shows up in the report. A
+ * water level error pauses the program, stopping Timer 1, so in the
+ * error sweep the error is only raised after each timed tick, and the
+ * program is reset and started again before the next one.
+ *
+ * The latency from the start button's rising edge to the program
+ * starting (through the button debouncing) is measured once.
+ *
+ * The motor soft start is traced from the start of a NORMAL program
+ * until the ramp from the wash to the rinse duty has finished: every
+ * OCR0B value the Timer 0 overflow ISR writes, and the share of the
+ * CPU that ISR takes while a ramp is running (it runs on every PWM
+ * period then).
+ *
+ * The CPU's active and sleeping cycles are also tallied while a
+ * program is running, while idle with the display on and after the
+ * idle timeout has put the MCU into power-down, and turned into a duty
+ * cycle and an estimated supply current for each state.
+ *
+ * The report is JSON on stdout so it can be stored and diffed per
+ * commit.
+ *
+ * Build and run:
+ *     gcc -O2 -o isr_bench sim/isr_bench.c -lsimavr -lelf
+ *     ./isr_bench AVRProgrammingTask.elf [mcu] > isr_report.json
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gelf.h>
+#include <libelf.h>
+#include <simavr/sim_avr.h>
+#include <simavr/sim_elf.h>
+#include <simavr/avr_ioport.h>
+
+#define F_CPU 8000000UL
+/* simavr core with the ATmega324A register map */
+#define MCU "atmega324pa"
+
+/* ATmega324A data space addresses of the registers we inspect */
+#define ADDR_TIMSK1 0x6F
+#define OCIE1A 1
+#define ADDR_TCCR1B 0x81
+#define CS1_MASK 0x07
+#define ADDR_OCR0B 0x48
+
+/* SMCR, whose SM2:0 bits give the sleep mode */
+#define ADDR_SMCR 0x53
+#define SM_MASK 0x0E
+#define SM_POWER_DOWN 0x04
+
+/* Assumed supply current in mA for each CPU state at 8 MHz and 5 V
+ * (typical ATmega324A figures; adjust for the board being modelled).
+ */
+#define CURRENT_ACTIVE 5.0
+#define CURRENT_IDLE 1.4
+#define CURRENT_POWER_DOWN 0.0002
+
+/* Length of each power measurement window, and the longest to wait
+ * for the idle timeout to power the MCU down.
+ */
+#define POWER_WINDOW (2 * F_CPU)
+#define POWER_DOWN_WAIT (120 * F_CPU)
+
+/* Port D pins */
+#define PIN_START 2
+#define PIN_RESET 3
+#define PIN_MODE 4
+
+/* Opcode of RETI */
+#define OP_RETI 0x9518
+/* Bytes per vector table entry (JMP) */
+#define VECTOR_SIZE 4
+
+/* Display refresh period: Timer 2 CTC at DISPLAY_REFRESH_HZ (1 kHz) */
+#define DISPLAY_PERIOD (F_CPU / 1000)
+
+/* Longest to wait for an ISR (a program tick is 187.5 ms), and for the
+ * firmware to pause the program once the water level error is raised.
+ */
+#define ISR_TIMEOUT F_CPU
+#define FAULT_TIMEOUT (F_CPU / 10)
+
+struct isrStats {
+	const char *name;
+	uint8_t vector;
+	uint32_t count;
+	uint64_t total;
+	uint32_t min;
+	uint32_t max;
+};
+
+static struct isrStats isrs[] = {
+	{"TIMER1_COMPA_vect", 13},
+	{"TIMER2_COMPA_vect", 9},
+	{"TIMER0_OVF_vect", 18},
+	{"EE_READY_vect", 25},
+	{"USART0_UDRE_vect", 21},
+	{"USART0_RX_vect", 20},
+	{"TIMER1_CAPT_vect", 12},
+	{"ADC_vect", 24},
+	{"TIMER1_OVF_vect", 15},
+	{"PCINT3_vect", 7},
+};
+#define ISR_COUNT (sizeof(isrs) / sizeof(isrs[0]))
+#define ISR_TIMER1 0
+#define ISR_TIMER0 2
+
+/* Most OCR0B changes kept in the ramp trace */
+#define RAMP_TRACE_MAX 128
+/* Ramp trace window: the wash phase of a NORMAL program (6 s) and the
+ * ramp on into rinse
+ */
+#define RAMP_WINDOW (F_CPU * 62 / 10)
+/* Timer 0 overflow period: fast PWM with no prescaling */
+#define PWM_PERIOD 256
+
+/* Motor ramp trace: each OCR0B value written by the Timer 0 overflow
+ * ISR and the cycle it was written on (relative to the start press),
+ * and the number of overflow ISRs and cycles spent in them.
+ */
+struct rampTrace {
+	int active;
+	avr_cycle_count_t start;
+	unsigned count;
+	uint64_t cycle[RAMP_TRACE_MAX];
+	uint8_t ocr0b[RAMP_TRACE_MAX];
+	uint32_t isrs;
+	uint64_t isrCycles;
+};
+
+/* Cycles spent awake, in idle sleep and in power-down */
+struct powerStats {
+	const char *name;
+	uint64_t active;
+	uint64_t idle;
+	uint64_t powerDown;
+};
+
+static avr_t *avr;
+static elf_firmware_t firmware;
+/* ISR currently executing (-1 if none) and the cycle it started on */
+static int current = -1;
+static avr_cycle_count_t entryCycle;
+/* Cycles taken by the most recent completed ISR */
+static uint32_t lastCycles;
+/* If >= 0, value written to timeCounter on entry to the Timer 1 ISR */
+static int forceTimeCounter = -1;
+static uint16_t timeCounterAddr;
+/* Power state currently being measured (NULL if none) */
+static struct powerStats *power;
+static struct rampTrace ramp;
+
+/* Find the data space address of a global in the firmware ELF. */
+static uint16_t findSymbol(const char *path, const char *symbol) {
+	Elf *elf;
+	Elf_Scn *scn = NULL;
+	GElf_Shdr shdr;
+	GElf_Sym sym;
+	uint16_t addr = 0;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0 || elf_version(EV_CURRENT) == EV_NONE) {
+		return 0;
+	}
+	elf = elf_begin(fd, ELF_C_READ, NULL);
+	while (elf && (scn = elf_nextscn(elf, scn)) != NULL) {
+		gelf_getshdr(scn, &shdr);
+		if (shdr.sh_type != SHT_SYMTAB) {
+			continue;
+		}
+		Elf_Data *data = elf_getdata(scn, NULL);
+		for (size_t i = 0; i < shdr.sh_size / shdr.sh_entsize; i++) {
+			gelf_getsym(data, i, &sym);
+			if (strcmp(elf_strptr(elf, shdr.sh_link, sym.st_name), symbol) == 0) {
+				/* data addresses are linked at 0x800000 */
+				addr = sym.st_value & 0xFFFF;
+			}
+		}
+	}
+	elf_end(elf);
+	close(fd);
+	return addr;
+}
+
+static void setPin(uint8_t pin, uint8_t value) {
+	avr_raise_irq(avr_io_getirq(avr, AVR_IOCTL_IOPORT_GETIRQ('D'), pin), value);
+}
+
+/* After a Timer 0 overflow ISR, note the OCR0B value if it changed. */
+static void recordRamp(void) {
+	uint8_t ocr0b = avr->data[ADDR_OCR0B];
+
+	ramp.isrs++;
+	ramp.isrCycles += lastCycles;
+	if ((ramp.count == 0 || ocr0b != ramp.ocr0b[ramp.count - 1])
+		&& ramp.count < RAMP_TRACE_MAX) {
+		ramp.cycle[ramp.count] = avr->cycle - ramp.start;
+		ramp.ocr0b[ramp.count] = ocr0b;
+		ramp.count++;
+	}
+}
+
+/* Execute one instruction, tracking ISR entry and exit. */
+static void step(void) {
+	uint16_t opcode = avr->flash[avr->pc] | (avr->flash[avr->pc + 1] << 8);
+
+	if (current < 0) {
+		for (unsigned i = 0; i < ISR_COUNT; i++) {
+			if (avr->pc == isrs[i].vector * VECTOR_SIZE) {
+				current = i;
+				entryCycle = avr->cycle;
+				if (i == ISR_TIMER1 && forceTimeCounter >= 0) {
+					avr->data[timeCounterAddr] = forceTimeCounter;
+				}
+				break;
+			}
+		}
+	}
+	avr_cycle_count_t before = avr->cycle;
+	uint8_t sleepMode = avr->data[ADDR_SMCR] & SM_MASK;
+	int sleeping = avr->state == cpu_Sleeping;
+	int state = avr_run(avr);
+	if (power) {
+		if (!sleeping) {
+			power->active += avr->cycle - before;
+		} else if (sleepMode == SM_POWER_DOWN) {
+			power->powerDown += avr->cycle - before;
+		} else {
+			power->idle += avr->cycle - before;
+		}
+	}
+	if (state == cpu_Done || state == cpu_Crashed) {
+		fprintf(stderr, "isr_bench: simulation stopped (state %d)\n", state);
+		exit(1);
+	}
+	if (current >= 0 && opcode == OP_RETI) {
+		struct isrStats *s = &isrs[current];
+		lastCycles = avr->cycle - entryCycle;
+		s->count++;
+		s->total += lastCycles;
+		if (s->count == 1 || lastCycles < s->min) {
+			s->min = lastCycles;
+		}
+		if (lastCycles > s->max) {
+			s->max = lastCycles;
+		}
+		if (ramp.active && current == ISR_TIMER0) {
+			recordRamp();
+		}
+		current = -1;
+	}
+}
+
+static void runCycles(avr_cycle_count_t n) {
+	avr_cycle_count_t end = avr->cycle + n;
+	while (avr->cycle < end) {
+		step();
+	}
+}
+
+/* Run until the given ISR has completed once. Stops the benchmark if
+ * it has not within ISR_TIMEOUT cycles.
+ */
+static void runUntilIsr(int isr) {
+	uint32_t count = isrs[isr].count;
+	avr_cycle_count_t end = avr->cycle + ISR_TIMEOUT;
+	while (isrs[isr].count == count) {
+		if (avr->cycle >= end) {
+			fprintf(stderr, "isr_bench: no %s within %lu cycles\n", isrs[isr].name, ISR_TIMEOUT);
+			exit(1);
+		}
+		step();
+	}
+}
+
+/* Whether Timer 1, which times the program ticks, is counting. */
+static int timer1Running(void) {
+	return (avr->data[ADDR_TCCR1B] & CS1_MASK) != 0;
+}
+
+/* Rising edge on a button pin, held for 100 ms so that it gets past
+ * the firmware's debouncing.
+ */
+static void press(uint8_t pin) {
+	setPin(pin, 1);
+	runCycles(F_CPU / 10);
+	setPin(pin, 0);
+	runCycles(F_CPU / 10);
+}
+
+static void setInputs(uint8_t pind) {
+	setPin(0, pind & 1);
+	setPin(1, (pind >> 1) & 1);
+	setPin(PIN_MODE, (pind >> PIN_MODE) & 1);
+}
+
+struct sweep {
+	const char *name;
+	uint8_t startInputs;   /* PIND while start is pressed and the tick is timed */
+	uint8_t runInputs;     /* PIND after each timed tick */
+	uint32_t cycles[256];
+	uint32_t worst;
+	uint8_t worstTimeCounter;
+};
+
+/* Force each timeCounter value in turn on entry to TIMER1_COMPA_vect
+ * and record how long the ISR takes. The program is started again
+ * whenever Timer 1 has stopped: once it has finished (the timer is
+ * stopped and its interrupt disabled) or been paused by runInputs (the
+ * timer is stopped with its interrupt still enabled, so it is reset
+ * first).
+ */
+static void runSweep(struct sweep *sw) {
+	avr_reset(avr);
+	current = -1;
+	setInputs(sw->startInputs);
+	runCycles(F_CPU / 100);
+	sw->worst = 0;
+	for (int tc = 0; tc < 256; tc++) {
+		if (!timer1Running()) {
+			setInputs(sw->startInputs);
+			if (avr->data[ADDR_TIMSK1] & (1 << OCIE1A)) {
+				press(PIN_RESET);
+			}
+			press(PIN_START);
+		}
+		forceTimeCounter = tc;
+		runUntilIsr(ISR_TIMER1);
+		forceTimeCounter = -1;
+		sw->cycles[tc] = lastCycles;
+		if (lastCycles > sw->worst) {
+			sw->worst = lastCycles;
+			sw->worstTimeCounter = tc;
+		}
+		if (sw->runInputs != sw->startInputs) {
+			avr_cycle_count_t end = avr->cycle + FAULT_TIMEOUT;
+			setInputs(sw->runInputs);
+			while (timer1Running()) {
+				if (avr->cycle >= end) {
+					fprintf(stderr, "isr_bench: %s inputs did not pause the program\n", sw->name);
+					exit(1);
+				}
+				step();
+			}
+		}
+	}
+	press(PIN_RESET);
+}
+
+/* Cycles from the rising edge of the start button until the debounced
+ * press has started the program timer.
+ */
+static uint64_t measureStartLatency(void) {
+	avr_cycle_count_t start;
+	uint64_t latency;
+
+	avr_reset(avr);
+	current = -1;
+	setInputs(0x01);
+	runCycles(F_CPU / 100);
+	setPin(PIN_START, 1);
+	start = avr->cycle;
+	while ((avr->data[ADDR_TIMSK1] & (1 << OCIE1A)) == 0 && avr->cycle - start < F_CPU) {
+		step();
+	}
+	latency = avr->cycle - start;
+	runCycles(F_CPU / 10);
+	setPin(PIN_START, 0);
+	press(PIN_RESET);
+	return latency;
+}
+
+/* Start a NORMAL program and trace the motor duty until it has ramped
+ * up to the wash duty and then on to the rinse duty.
+ */
+static void runRamp(void) {
+	avr_reset(avr);
+	current = -1;
+	setInputs(0x01);
+	runCycles(F_CPU / 100);
+	ramp.active = 1;
+	ramp.start = avr->cycle;
+	setPin(PIN_START, 1);
+	runCycles(F_CPU / 10);
+	setPin(PIN_START, 0);
+	runCycles(RAMP_WINDOW - F_CPU / 10);
+	ramp.active = 0;
+	press(PIN_RESET);
+}
+
+static int poweredDown(void) {
+	return avr->state == cpu_Sleeping
+		&& (avr->data[ADDR_SMCR] & SM_MASK) == SM_POWER_DOWN;
+}
+
+/* Measure a window of each power state: running a NORMAL program,
+ * idle with the display on, and powered down after the idle timeout.
+ */
+static void runPowerStates(struct powerStats *states) {
+	avr_cycle_count_t end;
+
+	avr_reset(avr);
+	current = -1;
+	setInputs(0x01);
+	runCycles(F_CPU / 100);
+	press(PIN_START);
+	power = &states[0];
+	runCycles(POWER_WINDOW);
+	power = NULL;
+	press(PIN_RESET);
+	power = &states[1];
+	runCycles(POWER_WINDOW);
+	power = NULL;
+	end = avr->cycle + POWER_DOWN_WAIT;
+	while (!poweredDown() && avr->cycle < end) {
+		step();
+	}
+	if (poweredDown()) {
+		power = &states[2];
+		runCycles(POWER_WINDOW);
+		power = NULL;
+	}
+}
+
+static void printPower(const struct powerStats *p, int last) {
+	uint64_t total = p->active + p->idle + p->powerDown;
+	double current = 0.0;
+	double duty = 0.0;
+
+	if (total) {
+		duty = (double)p->active / total;
+		current = (p->active * CURRENT_ACTIVE + p->idle * CURRENT_IDLE
+			+ p->powerDown * CURRENT_POWER_DOWN) / total;
+	}
+	printf("    \"%s\": {\"active_cycles\": %llu, \"idle_cycles\": %llu, "
+		"\"power_down_cycles\": %llu, \"duty_cycle\": %.4f, "
+		"\"current_ma\": %.4f}%s\n",
+		p->name, (unsigned long long)p->active, (unsigned long long)p->idle,
+		(unsigned long long)p->powerDown, duty, current, last ? "" : ",");
+}
+
+int main(int argc, char **argv) {
+	static struct sweep sweeps[] = {
+		{"NORMAL", 0x01, 0x01},
+		{"EXTENDED", 0x11, 0x11},
+		{"ERROR", 0x01, 0x03},
+	};
+	const unsigned sweepCount = sizeof(sweeps) / sizeof(sweeps[0]);
+	static struct powerStats states[] = {
+		{"running"},
+		{"idle"},
+		{"power_down"},
+	};
+	const unsigned stateCount = sizeof(states) / sizeof(states[0]);
+	const char *mcu = argc > 2 ? argv[2] : MCU;
+	uint64_t startLatency;
+
+	if (argc < 2) {
+		fprintf(stderr, "usage: %s firmware.elf [mcu]\n", argv[0]);
+		return 1;
+	}
+	if (elf_read_firmware(argv[1], &firmware) != 0) {
+		fprintf(stderr, "isr_bench: cannot read %s\n", argv[1]);
+		return 1;
+	}
+	timeCounterAddr = findSymbol(argv[1], "timeCounter");
+	if (timeCounterAddr == 0) {
+		fprintf(stderr, "isr_bench: no timeCounter symbol in %s\n", argv[1]);
+		return 1;
+	}
+	avr = avr_make_mcu_by_name(mcu);
+	if (!avr) {
+		fprintf(stderr, "isr_bench: simavr has no %s core\n", mcu);
+		return 1;
+	}
+	avr_init(avr);
+	avr->frequency = F_CPU;
+	avr->log = LOG_NONE;
+	avr_load_firmware(avr, &firmware);
+
+	for (unsigned i = 0; i < sweepCount; i++) {
+		runSweep(&sweeps[i]);
+	}
+	startLatency = measureStartLatency();
+	runRamp();
+	runPowerStates(states);
+
+	printf("{\n");
+	printf("  \"firmware\": \"%s\",\n", argv[1]);
+	printf("  \"mcu\": \"%s\",\n", mcu);
+	printf("  \"f_cpu\": %lu,\n", F_CPU);
+	printf("  \"display_period_cycles\": %lu,\n", DISPLAY_PERIOD);
+	printf("  \"start_latency_cycles\": %llu,\n", (unsigned long long)startLatency);
+	printf("  \"isrs\": {\n");
+	for (unsigned i = 0; i < ISR_COUNT; i++) {
+		struct isrStats *s = &isrs[i];
+		printf("    \"%s\": {\"vector\": %u, \"count\": %u, \"min\": %u, "
+			"\"max\": %u, \"mean\": %.1f}%s\n",
+			s->name, s->vector, s->count, s->min, s->max,
+			s->count ? (double)s->total / s->count : 0.0,
+			i + 1 < ISR_COUNT ? "," : "");
+	}
+	printf("  },\n");
+	printf("  \"timer1_sweep\": {\n");
+	for (unsigned i = 0; i < sweepCount; i++) {
+		struct sweep *sw = &sweeps[i];
+		printf("    \"%s\": {\"worst\": %u, \"worst_timeCounter\": %u, "
+			"\"worst_display_periods\": %.2f, \"cycles\": [",
+			sw->name, sw->worst, sw->worstTimeCounter,
+			(double)sw->worst / DISPLAY_PERIOD);
+		for (int tc = 0; tc < 256; tc++) {
+			printf("%u%s", sw->cycles[tc], tc < 255 ? "," : "");
+		}
+		printf("]}%s\n", i + 1 < sweepCount ? "," : "");
+	}
+	printf("  },\n");
+	/* while a ramp runs the ISR takes every overflow */
+	printf("  \"ramp\": {\"isrs\": %u, \"mean_cycles\": %.1f, "
+		"\"load_while_ramping\": %.4f, \"trace\": [",
+		ramp.isrs, ramp.isrs ? (double)ramp.isrCycles / ramp.isrs : 0.0,
+		ramp.isrs ? (double)ramp.isrCycles / ramp.isrs / PWM_PERIOD : 0.0);
+	for (unsigned i = 0; i < ramp.count; i++) {
+		printf("[%llu,%u]%s", (unsigned long long)ramp.cycle[i], ramp.ocr0b[i],
+			i + 1 < ramp.count ? "," : "");
+	}
+	printf("]},\n");
+	printf("  \"power\": {\n");
+	for (unsigned i = 0; i < stateCount; i++) {
+		printPower(&states[i], i + 1 == stateCount);
+	}
+	printf("  }\n");
+	printf("}\n");
+	return 0;
+}
@@ -0,0 +1,154 @@
+/*
+ * telemetry.c
+ *
+ * Decoder for the telemetry stream AVRProgrammingTask sends on USART0
+ * when built with TELEMETRY (the frame format is in telemetry.h).
+ *
+ * Reads the raw bytes from a file, or from stdin if none is given,
+ * splits them into frames at the zero bytes, undoes the COBS encoding
+ * and checks each frame's length and CRC. Every good frame is printed
+ * as one line: a status frame as its fields, a reply from the command
+ * shell (SHELL) as its text after "> ". Sequence numbers must follow
+ * on from the frame before, or start again from 0 after a reset; a gap
+ * means frames were lost on the line. The exit status is non-zero if
+ * any frame was bad or missing. A bad first frame is skipped without
+ * counting it, as a receiver started part way through a frame has to.
+ *
+ * Build and run, against the simulator's USART:
+ *     gcc -O2 -o telemetry sim/telemetry.c
+ *     gcc -DHAL_HOST -DLEVEL_ADC -DTELEMETRY -O2 -o washsim main.c hal_host.c
+ *     ./washsim 0 telemetry.bin && ./telemetry telemetry.bin
+ * or against the board (USB serial adapter on TXD0):
+ *     stty -F /dev/ttyUSB0 38400 raw && ./telemetry < /dev/ttyUSB0
+ * Shell commands are lines written to the same port, or to the
+ * pseudo-terminal "./washsim pty" runs the simulator on:
+ *     echo state > /dev/ttyUSB0
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include "../telemetry.h"
+
+/* Names of the firmware's states, as STATE_* in statemachine.h */
+static const char *const stateNames[] = {
+	"idle", "wash", "rinse", "spin", "finished", "error", "paused",
+};
+#define STATE_NAMES (sizeof(stateNames) / sizeof(stateNames[0]))
+
+/* CRC-8 of the given bytes, as crc8() in main.c */
+static uint8_t crc8(const uint8_t *bytes, int length) {
+	uint8_t crc = 0xFF;
+	int i;
+	while (length--) {
+		crc ^= *bytes++;
+		for (i = 0; i < 8; i++) {
+			crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+		}
+	}
+	return crc;
+}
+
+/* Undo the COBS encoding of a frame (without its zero byte), in place.
+ * Returns the decoded length, or -1 if the frame is malformed.
+ */
+static int cobsDecode(uint8_t *frame, int length) {
+	int in = 0;
+	int out = 0;
+	while (in < length) {
+		int code = frame[in++];
+		int i;
+		if (code == 0 || in + code - 1 > length) {
+			return -1;
+		}
+		for (i = 1; i < code; i++) {
+			frame[out++] = frame[in++];
+		}
+		if (code != 0xFF && in < length) {
+			frame[out++] = 0;
+		}
+	}
+	return out;
+}
+
+static uint16_t field16(const uint8_t *payload, int offset) {
+	return payload[offset] | (uint16_t)payload[offset + 1] << 8;
+}
+
+int main(int argc, char **argv) {
+	FILE *in = stdin;
+	uint8_t frame[256];
+	int length = 0;
+	int synced = 0;
+	int expected = -1; // next sequence number, -1 before the first frame
+	unsigned long frames = 0;
+	unsigned long bad = 0;
+	unsigned long missing = 0;
+	int c;
+
+	if (argc > 1 && (in = fopen(argv[1], "rb")) == NULL) {
+		perror(argv[1]);
+		return 1;
+	}
+	while ((c = getc(in)) != EOF) {
+		const uint8_t *p = frame;
+		uint8_t state;
+		int size;
+		int valid;
+
+		if (c != 0) {
+			if (length < (int)sizeof(frame)) {
+				frame[length] = c;
+			}
+			length++;
+			continue;
+		}
+		size = length <= (int)sizeof(frame) ? cobsDecode(frame, length) : -1;
+		length = 0;
+		if (size < TELEMETRY_TEXT + 1 || crc8(p, size - 1) != p[size - 1]) {
+			valid = 0;
+		} else if (p[TELEMETRY_TYPE] == TELEMETRY_STATUS) {
+			valid = (size == TELEMETRY_STATUS_LENGTH + 1);
+		} else {
+			valid = (p[TELEMETRY_TYPE] == TELEMETRY_REPLY && size <= TELEMETRY_PAYLOAD_MAX + 1);
+		}
+		if (!valid) {
+			// the first may be the tail of a frame sent before the stream started
+			if (synced) {
+				printf("bad frame (%d bytes)\n", size);
+				bad++;
+			}
+			synced = 1;
+			expected = -1;
+			continue;
+		}
+		synced = 1;
+		frames++;
+		if (expected >= 0 && p[TELEMETRY_SEQUENCE] != expected && p[TELEMETRY_SEQUENCE] != 0) {
+			printf("%d frames missing\n", (p[TELEMETRY_SEQUENCE] - expected) & 0xFF);
+			missing += (p[TELEMETRY_SEQUENCE] - expected) & 0xFF;
+		}
+		expected = (p[TELEMETRY_SEQUENCE] + 1) & 0xFF;
+		if (p[TELEMETRY_TYPE] == TELEMETRY_REPLY) {
+			printf("#%-3u > %.*s\n", p[TELEMETRY_SEQUENCE], size - 1 - TELEMETRY_TEXT,
+				(const char *)p + TELEMETRY_TEXT);
+			fflush(stdout);
+			continue;
+		}
+		state = p[TELEMETRY_STATE];
+		printf("#%-3u %-8s program=", p[TELEMETRY_SEQUENCE],
+			state < STATE_NAMES ? stateNames[state] : "?");
+		if (p[TELEMETRY_PROGRAM] == 0xFF) {
+			printf("-             ");
+		} else {
+			printf("%-5s%-8s ", (p[TELEMETRY_PROGRAM] & 2) ? "user" : "",
+				(p[TELEMETRY_PROGRAM] & 1) ? "extended" : "normal");
+		}
+		printf("phase=%u clock=%-3u pind=%02x duty=%-4u rpm=%-4u lost=%u/%u\n",
+			p[TELEMETRY_PHASE], field16(p, TELEMETRY_CLOCK), p[TELEMETRY_PIND],
+			field16(p, TELEMETRY_DUTY), field16(p, TELEMETRY_SPEED),
+			p[TELEMETRY_EVENTS_LOST], p[TELEMETRY_FRAMES_LOST]);
+		fflush(stdout);
+	}
+	printf("%lu frames, %lu bad, %lu missing\n", frames, bad, missing);
+	return bad != 0 || missing != 0 || frames == 0;
+}
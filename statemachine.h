@@ -0,0 +1,75 @@
+/*
+ * statemachine.h
+ *
+ * States, events and actions of the washing machine state machine.
+ * The transition table itself is in main.c; it is declared here so the
+ * host driver (hal_host.c) can check every entry of it.
+ */
+
+#ifndef STATEMACHINE_H_
+#define STATEMACHINE_H_
+
+#include "hal.h"
+
+/* Machine states. The three running states are in the same order as
+ * the LED patterns, so a phase's pattern gives its state.
+ */
+#define STATE_IDLE 0     // no program running, display shows the inputs
+#define STATE_WASH 1     // running the wash phase of a program
+#define STATE_RINSE 2    // running the rinse phase
+#define STATE_SPIN 3     // running the spin phase
+#define STATE_FINISHED 4 // program complete, display shows 00
+#define STATE_ERROR 5    // program paused while the water level shows an error
+#define STATE_PAUSED 6   // program paused by the start button
+#define STATE_COUNT 7
+
+/* Events. The first four and EVENT_CONTROL are posted by the ISRs to
+ * the main loop; the rest are raised by actions and dispatched straight
+ * away, so every change of state goes through the transition table.
+ * EVENT_QUEUE_SIZE must be a power of two; one slot is always left
+ * empty to tell full from empty.
+ */
+#define EVENT_NONE 0
+#define EVENT_TICK 1  // program tick: advance the running program
+#define EVENT_START 2 // debounced press of the start button (B0)
+#define EVENT_RESET 3 // debounced press of the reset button (B1)
+#define EVENT_INPUT 4 // the mode or water level switches changed
+#define EVENT_WASH 5  // the program entered a wash phase
+#define EVENT_RINSE 6 // the program entered a rinse phase
+#define EVENT_SPIN 7  // the program entered a spin phase
+#define EVENT_DONE 8  // the program's last phase has ended
+#define EVENT_FAULT 9 // the water level shows an error while running
+#define EVENT_MODE 10 // the mode switch no longer matches the running program
+#define EVENT_CONTROL 11 // time for the drum speed loop (SPEED_CONTROL only)
+#define EVENT_COUNT 12
+#define EVENT_QUEUE_SIZE 16
+#if (EVENT_QUEUE_SIZE & (EVENT_QUEUE_SIZE - 1)) != 0 || EVENT_QUEUE_SIZE > 256
+#error "EVENT_QUEUE_SIZE must be a power of two no larger than 256"
+#endif
+
+/* Actions run on a transition. Each returns the next event to
+ * dispatch, or EVENT_NONE.
+ */
+#define ACTION_NONE 0
+#define ACTION_START 1  // start the selected program, if there is one
+#define ACTION_TICK 2   // advance the program clock and phase
+#define ACTION_INPUT 3  // check the inputs against a running program
+#define ACTION_RESET 4  // stop the program and return to idle
+#define ACTION_FINISH 5 // stop the program and show that it has finished
+#define ACTION_PAUSE 6  // freeze the tick timer and the motor PWM
+#define ACTION_RESUME 7 // carry on from where the program was paused
+#define ACTION_LATE_TICK 8 // a tick counted before the program was paused
+#define ACTION_CONTROL 9 // run the drum speed loop
+#define ACTION_COUNT 10
+
+/* One entry of the transition table: the state to move to and the
+ * action to run on the way.
+ */
+struct transition {
+	uint8_t next;
+	uint8_t action;
+};
+
+extern const struct transition transitions[STATE_COUNT][EVENT_COUNT] PROGMEM;
+
+#endif /* STATEMACHINE_H_ */
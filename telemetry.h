@@ -0,0 +1,53 @@
+/*
+ * telemetry.h
+ *
+ * Telemetry frame format, shared by the firmware (main.c, built with
+ * TELEMETRY) and the decoder (sim/telemetry.c).
+ *
+ * Frames are sent over USART0 at TELEMETRY_BAUD, 8 data bits, no
+ * parity, 1 stop bit. Each frame is a payload followed by its CRC-8
+ * (polynomial 0x07, starting from 0xFF), COBS encoded so that it holds
+ * no zero bytes, then a zero byte that ends it. A receiver that starts
+ * part way through a frame picks up from the next zero byte.
+ *
+ * With SHELL the firmware also reads lines of text on USART0, each a
+ * command for its shell (see main.c), and answers every line with a
+ * reply frame.
+ */
+
+#ifndef TELEMETRY_H_
+#define TELEMETRY_H_
+
+#define TELEMETRY_BAUD 38400UL
+
+/* Status frame, sent on every program tick and change of state. The
+ * 16-bit fields are little endian.
+ */
+#define TELEMETRY_STATUS 1
+#define TELEMETRY_TYPE 0         // TELEMETRY_STATUS
+#define TELEMETRY_SEQUENCE 1     // one more than the frame before (mod 256), 0 after a reset
+#define TELEMETRY_STATE 2        // STATE_* in statemachine.h
+#define TELEMETRY_PROGRAM 3      // 0 = normal, 1 = extended, + 2 for a user program, 0xFF = none running
+#define TELEMETRY_PHASE 4        // index of the phase the program is in
+#define TELEMETRY_CLOCK 5        // program clock, in ticks (2 bytes)
+#define TELEMETRY_PIND 7         // switches and buttons, as read from PIND
+#define TELEMETRY_DUTY 8         // motor PWM compare value; the duty is inverted (2 bytes)
+#define TELEMETRY_SPEED 10       // measured drum speed in rpm, 0 without SPEED_CONTROL (2 bytes)
+#define TELEMETRY_EVENTS_LOST 12 // events dropped by the full event queue (mod 256)
+#define TELEMETRY_FRAMES_LOST 13 // frames dropped by the full telemetry queue (mod 256)
+#define TELEMETRY_STATUS_LENGTH 14
+
+/* Reply frame: the command shell's answer to a command line, as text
+ * with no line ending. Failed commands answer "error: " and why.
+ */
+#define TELEMETRY_REPLY 2
+#define TELEMETRY_TEXT 2 // the text, up to TELEMETRY_TEXT_MAX bytes
+#define TELEMETRY_TEXT_MAX 64
+
+/* Longest frame on the wire: the longest payload and its CRC, the COBS
+ * code byte in front and the zero byte after.
+ */
+#define TELEMETRY_PAYLOAD_MAX (TELEMETRY_TEXT + TELEMETRY_TEXT_MAX)
+#define TELEMETRY_FRAME_MAX (TELEMETRY_PAYLOAD_MAX + 3)
+
+#endif /* TELEMETRY_H_ */